@@ -0,0 +1,111 @@
+/*
+ * buf.c - growable, append-only byte buffer for assembling messages.
+ *
+ * Appends copy onto the end and double the capacity when it runs out,
+ * so building a message is linear in its length however many pieces it
+ * has, and it cannot overflow. The result is sent with writev through
+ * an iovec view, next to other pieces that need not be copied into it.
+ */
+/* $begin buf.c */
+#include "buf.h"
+
+/* makes an empty buffer */
+void buf_init(Buf_t *b) {
+    b->data = (char *)Malloc(BUF_SIZE);
+    b->data[0] = '\0';
+    b->len = 0;
+    b->size = BUF_SIZE;
+}
+
+/* frees the bytes of a buffer, which is empty again */
+void buf_free(Buf_t *b) {
+    Free(b->data);
+    b->data = NULL;
+    b->len = b->size = 0;
+}
+
+/* makes room for n more bytes and the null */
+static void reserve(Buf_t *b, size_t n) {
+    size_t size = b->size ? b->size : BUF_SIZE;
+
+    if (b->len + n < b->size) {
+        return;
+    }
+    while (b->len + n >= size) {
+        size *= 2;
+    }
+    b->data = (char *)Realloc(b->data, size);
+    b->size = size;
+}
+
+/* appends n bytes */
+void buf_append(Buf_t *b, const void *p, size_t n) {
+    reserve(b, n);
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+    b->data[b->len] = '\0';
+}
+
+/* appends a string */
+void buf_puts(Buf_t *b, const char *s) {
+    buf_append(b, s, strlen(s));
+}
+
+/* appends printf formatted text, formatting again if it did not fit */
+void buf_printf(Buf_t *b, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    reserve(b, 0);
+    va_start(ap, fmt);
+    n = vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        b->data[b->len] = '\0';
+        return;
+    }
+    if (b->len + n >= b->size) {
+        reserve(b, n);
+        va_start(ap, fmt);
+        vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+        va_end(ap);
+    }
+    b->len += n;
+}
+
+/* points iov at the bytes of the buffer from off on */
+void buf_iov(Buf_t *b, size_t off, struct iovec *iov) {
+    iov->iov_base = b->data + off;
+    iov->iov_len = b->len - off;
+}
+
+/*
+ * buf_writev - writes the iovcnt pieces of iov to fd with writev,
+ * resuming after short writes, which uses iov up; returns the bytes
+ * written or -1 on error
+ */
+ssize_t buf_writev(int fd, struct iovec *iov, int iovcnt) {
+    ssize_t n, total = 0;
+
+    while (iovcnt > 0) {
+        if ((n = writev(fd, iov, iovcnt)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += n;
+        /* skip what was written */
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return total;
+}
+/* $end buf.c */
@@ -0,0 +1,50 @@
+/*
+ * buf.h - growable, append-only byte buffer for assembling messages,
+ * definition and prototypes.
+ */
+/* $begin buf.h */
+#ifndef __BUF_H__
+#define __BUF_H__
+
+#include "csapp.h"
+#include <stdarg.h>
+#include <sys/uio.h>
+
+#define BUF_SIZE 1024  /* initial capacity of a buffer */
+
+typedef struct Buf {
+    char *data;   /* Malloc'd, null terminated after every append */
+    size_t len;   /* bytes appended */
+    size_t size;  /* bytes of data */
+} Buf_t;
+
+/* function prototypes */
+
+/* makes an empty buffer */
+void buf_init(Buf_t *b);
+
+/* frees the bytes of a buffer, which is empty again */
+void buf_free(Buf_t *b);
+
+/* appends n bytes */
+void buf_append(Buf_t *b, const void *p, size_t n);
+
+/* appends a string */
+void buf_puts(Buf_t *b, const char *s);
+
+/* appends printf formatted text */
+void buf_printf(Buf_t *b, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* points iov at the bytes of the buffer from off on */
+void buf_iov(Buf_t *b, size_t off, struct iovec *iov);
+
+/*
+ * writes the iovcnt pieces of iov to fd with writev, resuming after
+ * short writes, which uses iov up; returns the bytes written or -1 on
+ * error
+ */
+ssize_t buf_writev(int fd, struct iovec *iov, int iovcnt);
+
+#endif /* __BUF_H__ */
+/* $end buf.h */
@@ -1,73 +1,168 @@
 /*
- * cache.c - LFU and LRU cache for web proxy, double linked list implementation.
+ * cache.c - sharded cache for web proxy, hash index and node management.
+ *
+ * The order in which nodes are evicted is left to cache_policy (see
+ * policy.h); this file owns the hash index, size accounting, locking and
+ * node lifetime.
+ *
+ * The cache is split into CACHE_SHARDS shards selected by uri hash, each
+ * locked on its own, while cache_size keeps the total within MAX_CACHE_SIZE.
+ *
+ * In lock-free mode readers walk the hash index under epoch protection
+ * instead of the shard's read lock. Writers still take the shard's write
+ * lock and publish nodes with release stores, and freed nodes go through
+ * epoch_retire so no reader can still be looking at them.
  */
 /* $begin cache.c */
 #include "cache.h"
+#include "policy.h"
+#include "hash.h"
 
-/* LFU cache */
-Node_t *LFU_head;
-Node_t *LFU_tail;
-volatile int LFU_len;
-volatile size_t LFU_size;
+/* shards, each with its own policy state, hash index and locks */
+Shard_t shards[CACHE_SHARDS];
 
-/* LRU cache */
-Node_t *LRU_head;
-Node_t *LRU_tail;
-volatile int LRU_len;
-volatile size_t LRU_size;
+/* total size of cached responses over all shards */
+volatile size_t cache_size;
 
-/* semaphores */
-volatile int read_count;
-sem_t sem_r;  /* semaphore for read_count (NOT for cache read) */
-sem_t sem_w;  /* semaphore for cache write */
+/* responses dropped from the cache since init_cache */
+volatile unsigned long cache_evictions;
+
+/* lock-free read path */
+int cache_lockfree;
+
+/* admission policy */
+int cache_admission;
+
+/* eviction policy */
+Policy_t *cache_policy = &lfulru_policy;
+
+/* next shard to evict from when a shard cannot free enough by itself */
+static volatile unsigned int evict_cursor;
+
+static void exit_record(Epoch_t *rec);
 
 /* functions */
 
 /* creates a node with given uri and response */
 Node_t *create_node(char *uri, char *response, int response_size) {
-    Node_t *node = (Node_t *)Malloc(sizeof(Node_t));
+    size_t uri_len = (uri != NULL) ? strlen(uri) + 1 : 0;
+    if (response == NULL) {
+        response_size = 0;
+    }
+    Node_t *node = (Node_t *)Malloc(sizeof(Node_t) + uri_len + response_size);
     if (uri != NULL) {
-        strcpy(node->uri, uri);
+        node->uri = node->data;
+        memcpy(node->uri, uri, uri_len);
+    } else {
+        node->uri = NULL;
     }
-    if (response != NULL && response_size) {
+    node->response = node->data + uri_len;
+    if (response_size) {
         memcpy(node->response, response, response_size);
-        node->size = response_size;
-    } else {
-        node->size = 0;
     }
+    node->size = response_size;
     node->count = 0;
+    node->hash = (uri != NULL) ? hash_uri(uri) : 0;
+    node->hnext = NULL;
+    node->freq = NULL;
+    node->list = 0;
+    node->index = -1;
+    node->priority = 0;
+    node->in_cache = 0;
+    node->refcount = 1;
     return node;
 }
 
+/* computes the case-insensitive hash of a uri */
+unsigned int hash_uri(char *uri) {
+    return hash_str(uri);
+}
+
+/* returns the shard that owns a given hash */
+Shard_t *get_shard(unsigned int hash) {
+    return &shards[hash & (CACHE_SHARDS - 1)];
+}
+
+/* returns the bucket of a given hash inside its shard */
+static Node_t **get_bucket(unsigned int hash) {
+    return &get_shard(hash)->hash_table[(hash / CACHE_SHARDS) & (SHARD_BUCKETS - 1)];
+}
+
 /* checks whether the uri in a given node is the same as a given uri */
-int cmp(Node_t *node, char *uri) {
-    if (node->uri == NULL || uri == NULL) {
-        /* dummy node is not comparable */
+int cmp(Node_t *node, char *uri, unsigned int hash) {
+    if (uri == NULL) {
+        /* dummy nodes have no hash entry, only a missing uri gets here */
         printf("Error: dummy node is not comparable.");
         return 0;
     }
+    if (node->hash != hash) {
+        return 0;
+    }
     return (strcasecmp(node->uri, uri) == 0) ? 1 : 0;
 }
 
 /* initializes cache */
 void init_cache() {
-    LFU_head = create_node(NULL, NULL, 0);  /* dummy node */
-    LFU_tail = create_node(NULL, NULL, 0);  /* dummy node */
-    LFU_head->next = LFU_tail;
-    LFU_tail->prev = LFU_head;
-    LFU_len = 0;
-    LRU_size = 0;
+    int i;
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        Shard_t *shard = &shards[i];
+
+        shard->len = 0;
+        shard->size = 0;
+        cache_policy->init(shard);
+
+        memset(shard->hash_table, 0, sizeof(shard->hash_table));
+
+        if (cache_admission == ADMIT_TINYLFU) {
+            sketch_init(&shard->sketch, SHARD_SKETCH_WIDTH);
+        }
+
+        shard->read_count = 0;
+        Sem_init(&shard->sem_r, 0, 1);
+        Sem_init(&shard->sem_w, 0, 1);
+    }
+    cache_size = 0;
+    cache_evictions = 0;
+    evict_cursor = 0;
+    if (cache_lockfree) {
+        epoch_set_exit(exit_record);
+    }
+}
+
+/* evicts everything and frees the cache, no node may still be pinned */
+void destroy_cache() {
+    Node_t *victim;
+    int i;
 
-    LRU_head = create_node(NULL, NULL, 0);  /* dummy node */
-    LRU_tail = create_node(NULL, NULL, 0);  /* dummy node */
-    LRU_head->next = LRU_tail;
-    LRU_tail->prev = LRU_head;
-    LRU_len = 0;
-    LRU_size = 0;
+    if (cache_lockfree) {
+        drain_access();
+    }
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        Shard_t *shard = &shards[i];
+        while ((victim = cache_policy->peek(shard)) != NULL) {
+            evict_node(shard, victim);
+        }
+        cache_policy->destroy(shard);
+        shard->policy_data = NULL;
+        if (cache_admission == ADMIT_TINYLFU) {
+            sketch_free(&shard->sketch);
+        }
+        sem_destroy(&shard->sem_r);
+        sem_destroy(&shard->sem_w);
+    }
+    if (cache_lockfree) {
+        epoch_reclaim();
+    }
+}
 
-    read_count = 0;
-    Sem_init(&sem_r, 0, 1);
-    Sem_init(&sem_w, 0, 1);
+/* creates an empty list between two dummy nodes */
+void init_list(Node_t **head, Node_t **tail) {
+    *head = create_node(NULL, NULL, 0);  /* dummy node */
+    *tail = create_node(NULL, NULL, 0);  /* dummy node */
+    (*head)->prev = NULL;
+    (*head)->next = *tail;
+    (*tail)->prev = *head;
+    (*tail)->next = NULL;
 }
 
 /* inserts node cur after node pos */
@@ -83,7 +178,18 @@ void insert_node(Node_t *cur, Node_t *pos) {
     cur->next->prev = cur;
 }
 
-/* removes node cur, returns the node before it */
+/* drops a reference to node cur, frees it when the last one is gone */
+void release_node(Node_t *cur) {
+    if (__sync_sub_and_fetch(&cur->refcount, 1) == 0) {
+        if (cache_lockfree) {
+            epoch_retire(cur);
+        } else {
+            Free(cur);
+        }
+    }
+}
+
+/* unlinks node cur from its list, returns the node before it */
 Node_t *remove_node(Node_t *cur) {
     if (cur == NULL || cur->prev == NULL || cur->next == NULL) {
         /* dummy node cannot be removed */
@@ -93,7 +199,6 @@ Node_t *remove_node(Node_t *cur) {
     Node_t *tmp = cur->prev;
     tmp->next = cur->next;
     tmp->next->prev = tmp;
-    Free(cur);
     return tmp;
 }
 
@@ -114,115 +219,278 @@ void move_node(Node_t *cur, Node_t *pos) {
     insert_node(cur, pos);
 }
 
-/* finds a node with the given uri from head */
-Node_t *find_node(char *uri, Node_t *head) {
-    Node_t *cur = head->next;
-    while (cur->next != NULL) {
-        if (cmp(cur, uri)) {
+/* adds node cur to the hash index of its shard */
+void hash_insert(Node_t *cur) {
+    Node_t **bucket = get_bucket(cur->hash);
+    cur->hnext = *bucket;
+    __atomic_store_n(bucket, cur, __ATOMIC_RELEASE);
+}
+
+/* removes node cur from the hash index of its shard */
+void hash_remove(Node_t *cur) {
+    Node_t **pos = get_bucket(cur->hash);
+    while (*pos != NULL) {
+        if (*pos == cur) {
+            /* cur->hnext is kept so lock-free readers on cur can go on */
+            __atomic_store_n(pos, cur->hnext, __ATOMIC_RELEASE);
+            return;
+        }
+        pos = &(*pos)->hnext;
+    }
+}
+
+/* finds a node with the given uri and hash in a shard */
+Node_t *find_node(Shard_t *shard, char *uri, unsigned int hash) {
+    Node_t **bucket = &shard->hash_table[(hash / CACHE_SHARDS) & (SHARD_BUCKETS - 1)];
+    Node_t *cur = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+    while (cur != NULL) {
+        if (cmp(cur, uri, hash)) {
             return cur;
         }
-        cur = cur->next;
+        cur = __atomic_load_n(&cur->hnext, __ATOMIC_ACQUIRE);
     }
     return NULL;
 }
 
-/* updates cache after accessing a uri */
-void access_node(char *uri) {
-    P(&sem_w);
+/* takes the read side of a shard's readers-writer lock */
+static void read_lock(Shard_t *shard) {
+    P(&shard->sem_r);
+    shard->read_count++;
+    if (shard->read_count == 1) {
+        P(&shard->sem_w);
+    }
+    V(&shard->sem_r);
+}
+
+/* releases the read side of a shard's readers-writer lock */
+static void read_unlock(Shard_t *shard) {
+    P(&shard->sem_r);
+    shard->read_count--;
+    if (shard->read_count == 0) {
+        V(&shard->sem_w);
+    }
+    V(&shard->sem_r);
+}
 
-    Node_t *tmp = find_node(uri, LFU_head);
+/* evicts node cur from a shard whose write lock is held */
+void evict_node(Shard_t *shard, Node_t *cur) {
+    cache_policy->remove(shard, cur);
+    shard->len--;
+    shard->size -= cur->size;
+    __sync_sub_and_fetch(&cache_size, cur->size);
+    __atomic_fetch_add(&cache_evictions, 1, __ATOMIC_RELAXED);
+    hash_remove(cur);
+    cur->in_cache = 0;
+    release_node(cur);
+}
 
-    if (tmp) {
-        /* uri in LFU */
-        tmp->count++;
-        while (tmp->prev != LFU_head && tmp->count > tmp->prev->count) {
-            move_node(tmp, tmp->prev->prev);
+/*
+ * evicts from the other shards, one node at a time, until the cache fits
+ * in MAX_CACHE_SIZE. Only one shard lock is held at a time.
+ */
+static void evict_others(Shard_t *self) {
+    int idle = 0;
+    while (cache_size > MAX_CACHE_SIZE && idle < CACHE_SHARDS) {
+        Shard_t *shard = &shards[__sync_fetch_and_add(&evict_cursor, 1) & (CACHE_SHARDS - 1)];
+        if (shard == self) {
+            idle++;
+            continue;
         }
-    } else {
-        /* uri not in LFU */
-        tmp = find_node(uri, LRU_head);
-        if (tmp) {
-            /* uri in LRU */
-            tmp->count++;
-            if (LFU_len < MAX_LFU_LEN || tmp->count > LFU_tail->prev->count) {
-                move_node(tmp, LFU_tail->prev);
-                LRU_size -= tmp->size;
-                LRU_len--;
-                LFU_size += tmp->size;
-                LFU_len++;
-                while (tmp->prev != LFU_head && tmp->count > tmp->prev->count) {
-                    move_node(tmp, tmp->prev->prev);
-                }
-                while (LFU_len > MAX_LFU_LEN) {
-                    LFU_size -= LFU_tail->prev->size;
-                    remove_node(LFU_tail->prev);
-                    LFU_len--;
-                }
-            } else {
-                move_node(tmp, LRU_head);
+        P(&shard->sem_w);
+        Node_t *victim = cache_policy->victim(shard);
+        if (victim != NULL) {
+            evict_node(shard, victim);
+            idle = 0;
+        } else {
+            idle++;
+        }
+        V(&shard->sem_w);
+    }
+}
+
+/* updates a shard whose write lock is held after accessing node cur */
+static void update_node(Shard_t *shard, Node_t *cur) {
+    if (cache_admission == ADMIT_TINYLFU) {
+        sketch_increment(&shard->sketch, cur->hash);
+    }
+    if (cur->in_cache) {
+        cache_policy->hit(shard, cur);
+    }
+}
+
+/* applies the hits buffered in a thread's record */
+static void drain_record(Epoch_t *rec) {
+    Access_buf_t *buf = (Access_buf_t *)rec->data;
+    Shard_t *locked = NULL;
+    int i;
+
+    if (buf == NULL) {
+        return;
+    }
+    for (i = 0; i < buf->len; i++) {
+        Shard_t *shard = get_shard(buf->nodes[i]->hash);
+        if (shard != locked) {
+            /* consecutive hits on one shard share the lock */
+            if (locked != NULL) {
+                V(&locked->sem_w);
             }
+            P(&shard->sem_w);
+            locked = shard;
         }
+        update_node(shard, buf->nodes[i]);
+    }
+    if (locked != NULL) {
+        V(&locked->sem_w);
     }
-    V(&sem_w);
+    for (i = 0; i < buf->len; i++) {
+        release_node(buf->nodes[i]);
+    }
+    buf->len = 0;
+}
+
+/* drains and frees the buffer of an exiting thread */
+static void exit_record(Epoch_t *rec) {
+    drain_record(rec);
+    Free(rec->data);
 }
 
-/* gets the cached response with the given uri if it exists */
-int get_cache(char *uri, char *response) {
-    int response_size = 0;
-    P(&sem_r);
-    read_count++;
-    if (read_count == 1) {
-        P(&sem_w);
+/* applies the hits buffered by the calling thread */
+void drain_access() {
+    drain_record(epoch_self());
+}
+
+/* updates cache after accessing node cur */
+void access_node(Node_t *cur) {
+    if (cache_lockfree) {
+        Epoch_t *rec = epoch_self();
+        Access_buf_t *buf = (Access_buf_t *)rec->data;
+        if (buf == NULL) {
+            buf = (Access_buf_t *)Calloc(1, sizeof(Access_buf_t));
+            rec->data = buf;
+        }
+        __sync_add_and_fetch(&cur->refcount, 1);
+        buf->nodes[buf->len++] = cur;
+        if (buf->len == ACCESS_BUF_LEN) {
+            drain_record(rec);
+        }
+        return;
     }
-    V(&sem_r);
 
-    Node_t *tmp = find_node(uri, LFU_head);
-    if (tmp == NULL) {
-        /* uri not in LFU */
-        tmp = find_node(uri, LRU_head);
+    Shard_t *shard = get_shard(cur->hash);
+    P(&shard->sem_w);
+    update_node(shard, cur);
+    V(&shard->sem_w);
+}
+
+/*
+ * gets the cached node with the given uri if it exists, the node is
+ * pinned and must be given back with release_node
+ */
+Node_t *get_cache(char *uri) {
+    unsigned int hash = hash_uri(uri);
+    Shard_t *shard = get_shard(hash);
+    Node_t *tmp;
+
+    if (cache_lockfree) {
+        epoch_enter();
+        tmp = find_node(shard, uri, hash);
+        /* pin unless the last reference is already gone */
+        while (tmp) {
+            int refcount = tmp->refcount;
+            if (refcount == 0) {
+                tmp = NULL;
+            } else if (__sync_bool_compare_and_swap(&tmp->refcount, refcount, refcount + 1)) {
+                break;
+            }
+        }
+        epoch_exit();
+        return tmp;
     }
 
+    read_lock(shard);
+
+    tmp = find_node(shard, uri, hash);
     if (tmp) {
-        memcpy(response, tmp->response, tmp->size);
-        response_size = tmp->size;
+        __sync_add_and_fetch(&tmp->refcount, 1);
     }
 
-    P(&sem_r);
-    read_count--;
-    if (read_count == 0) {
-        V(&sem_w);
+    read_unlock(shard);
+    return tmp;
+}
+
+/*
+ * decides whether a new object of the given hash and size may be cached
+ * in a shard whose write lock is held. With TinyLFU admission, an object
+ * that needs an eviction is only admitted if it has been requested more
+ * often than the victim it would replace.
+ */
+static int admit(Shard_t *shard, unsigned int hash, int size) {
+    Node_t *victim;
+
+    if (cache_admission != ADMIT_TINYLFU) {
+        return 1;
+    }
+    if (cache_size + size <= MAX_CACHE_SIZE && shard->len < SHARD_MAX_LEN) {
+        return 1;
+    }
+    if ((victim = cache_policy->peek(shard)) == NULL) {
+        return 1;
     }
-    V(&sem_r);
-    return response_size;
+    return sketch_estimate(&shard->sketch, hash) >
+           sketch_estimate(&shard->sketch, victim->hash);
 }
 
-/* puts (uri, response) into the cache */
+/*
+ * puts (uri, response) into the cache, returns the pinned node, or NULL
+ * if the object is too large or not admitted
+ */
 Node_t *put_cache(char *uri, char *response, int response_size) {
     if (response_size > MAX_OBJECT_SIZE) {
         return NULL;
     }
 
-    P(&sem_w);
+    unsigned int hash = hash_uri(uri);
+    Shard_t *shard = get_shard(hash);
 
-    Node_t *tmp = find_node(uri, LFU_head);
-    if (tmp == NULL) {
-        /* uri not in LFU */
-        tmp = find_node(uri, LRU_head);
+    P(&shard->sem_w);
+
+    if (cache_admission == ADMIT_TINYLFU) {
+        sketch_increment(&shard->sketch, hash);
     }
 
+    Node_t *tmp = find_node(shard, uri, hash);
+
     if (tmp == NULL) {
-        tmp = create_node(uri, response, response_size);
-        insert_node(tmp, LRU_head);
-        LRU_len++;
-        LRU_size += tmp->size;
-        while (LRU_len > MAX_LRU_LEN || LRU_size + LFU_size > MAX_CACHE_SIZE) {
-            LRU_size -= LRU_tail->prev->size;
-            remove_node(LRU_tail->prev);
-            LRU_len--;
+        if (!admit(shard, hash, response_size)) {
+            V(&shard->sem_w);
+            return NULL;
         }
+        /* make room first so the new node is never its own victim */
+        while (shard->len >= SHARD_MAX_LEN ||
+               cache_size + response_size > MAX_CACHE_SIZE) {
+            Node_t *victim = cache_policy->victim(shard);
+            if (victim == NULL) {
+                break;
+            }
+            evict_node(shard, victim);
+        }
+        tmp = create_node(uri, response, response_size);
+        hash_insert(tmp);
+        tmp->in_cache = 1;
+        shard->len++;
+        shard->size += tmp->size;
+        __sync_add_and_fetch(&cache_size, tmp->size);
+        cache_policy->insert(shard, tmp);
     }
 
-    V(&sem_w);
+    __sync_add_and_fetch(&tmp->refcount, 1);
+
+    V(&shard->sem_w);
+
+    if (cache_size > MAX_CACHE_SIZE) {
+        /* this shard alone could not make room */
+        evict_others(shard);
+    }
 
     return tmp;
 }
@@ -1,75 +1,196 @@
 /*
- * cache.h - LFU and LRU cache for web proxy, definition and prototypes.
+ * cache.h - sharded cache for web proxy with pluggable eviction policies,
+ * definition and prototypes.
  */
 /* $begin cache.h */
 #ifndef __CACHE_H__
 #define __CACHE_H__
 
 #include "csapp.h"
+#include "epoch.h"
+#include "sketch.h"
 
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
 #define MAX_LRU_LEN 1000
-#define MAX_LFU_LEN 3
+#ifndef MAX_LFU_LEN
+#define MAX_LFU_LEN 3   /* per shard */
+#endif
 
-/* double linked list node */
+/* number of independently locked shards, must be a power of 2 */
+#ifndef CACHE_SHARDS
+#define CACHE_SHARDS 8
+#endif
+
+/* number of hash buckets for uri lookup, must be a power of 2 */
+#ifndef CACHE_BUCKETS
+#define CACHE_BUCKETS 1024
+#endif
+
+/* hits buffered per thread before they are applied, lock-free mode only */
+#define ACCESS_BUF_LEN 32
+
+/* counters per sketch row in each shard, TinyLFU admission only */
+#define SHARD_SKETCH_WIDTH 1024
+
+/* admission policies for put_cache */
+#define ADMIT_ALL 0      /* every new object is cached */
+#define ADMIT_TINYLFU 1  /* only objects more popular than the victim */
+
+#define SHARD_BUCKETS (CACHE_BUCKETS / CACHE_SHARDS)
+#define SHARD_LRU_LEN (MAX_LRU_LEN / CACHE_SHARDS)
+#define SHARD_MAX_LEN (SHARD_LRU_LEN + MAX_LFU_LEN)
+#define SHARD_CAPACITY (MAX_CACHE_SIZE / CACHE_SHARDS)
+
+/*
+ * double linked list node, allocated with exactly enough room for its
+ * uri and response, which are stored in data[] after the header
+ */
 typedef struct Node {
-    struct Node *prev;
+    struct Node *prev;   /* list links, owned by the eviction policy */
     struct Node *next;
-    char uri[MAXLINE];
-    char response[MAX_OBJECT_SIZE];
+    struct Node *hnext;  /* next node in the same hash bucket */
+    struct Freq *freq;   /* frequency bucket, lfulru policy only */
+    unsigned int hash;   /* hash of uri */
+    int list;            /* which list of the policy holds the node */
+    int in_cache;        /* 0 once the node has been evicted */
+    volatile int refcount;  /* the cache's reference plus one per reader */
+    char *uri;           /* NULL for dummy nodes */
+    char *response;
     size_t size;
-    int count;
+    int count;           /* access count kept by the policy */
+    int index;           /* heap position, gdsf policy only */
+    double priority;     /* gdsf policy only */
+    char data[];
 } Node_t;
 
-/* LFU cache */
-extern Node_t *LFU_head;
-extern Node_t *LFU_tail;
-extern volatile int LFU_len;
-extern volatile size_t LFU_size;
+/* one shard of the cache, owns the uris whose hash selects it */
+typedef struct Shard {
+    /* eviction policy state */
+    void *policy_data;
+
+    /* number and total size of cached nodes */
+    int len;
+    size_t size;
+
+    /* hash index of all cached nodes */
+    Node_t *hash_table[SHARD_BUCKETS];
+
+    /* access frequencies for TinyLFU admission */
+    Sketch_t sketch;
+
+    /* semaphores */
+    int read_count;
+    sem_t sem_r;  /* semaphore for read_count (NOT for cache read) */
+    sem_t sem_w;  /* semaphore for shard write */
+} Shard_t;
+
+/*
+ * eviction policy, every function is called with the shard's write lock
+ * held. The policy orders the nodes of a shard and picks victims; the
+ * cache owns the hash index, size accounting and node memory.
+ */
+typedef struct Policy {
+    char *name;
+    void (*init)(Shard_t *shard);                /* sets up policy_data */
+    void (*insert)(Shard_t *shard, Node_t *cur); /* a new node is cached */
+    void (*hit)(Shard_t *shard, Node_t *cur);    /* a cached node is accessed */
+    Node_t *(*victim)(Shard_t *shard);           /* next node to evict, or NULL */
+    Node_t *(*peek)(Shard_t *shard);             /* like victim, reordering nothing */
+    void (*remove)(Shard_t *shard, Node_t *cur); /* a node is evicted */
+    void (*destroy)(Shard_t *shard);             /* frees policy_data, shard is empty */
+} Policy_t;
+
+/* hits recorded by one thread and not applied to the lists yet */
+typedef struct Access_buf {
+    int len;
+    Node_t *nodes[ACCESS_BUF_LEN];  /* pinned until drained */
+} Access_buf_t;
+
+extern Shard_t shards[CACHE_SHARDS];
+
+/* total size of cached responses over all shards */
+extern volatile size_t cache_size;
+
+/* responses dropped from the cache since init_cache */
+extern volatile unsigned long cache_evictions;
+
+/*
+ * when set before init_cache, get_cache takes no lock and access_node
+ * records hits in a per-thread buffer applied in batches
+ */
+extern int cache_lockfree;
 
-/* LRU cache */
-extern Node_t *LRU_head;
-extern Node_t *LRU_tail;
-extern volatile int LRU_len;
-extern volatile size_t LRU_size;
+/* admission policy, one of ADMIT_*, set before init_cache */
+extern int cache_admission;
 
-/* semaphores */
-extern volatile int read_count;
-extern sem_t sem_r;  /* semaphore for read_count (NOT for cache read) */
-extern sem_t sem_w;  /* semaphore for cache write */
+/* eviction policy, set before init_cache */
+extern Policy_t *cache_policy;
 
 /* function prototypes */
 
 /* creates a node with given uri and response */
 Node_t *create_node(char *uri, char *response, int response_size);
 
+/* computes the case-insensitive hash of a uri */
+unsigned int hash_uri(char *uri);
+
+/* returns the shard that owns a given hash */
+Shard_t *get_shard(unsigned int hash);
+
 /* checks whether the uri in a given node is the same as a given uri */
-int cmp(Node_t *node, char *uri);
+int cmp(Node_t *node, char *uri, unsigned int hash);
 
 /* initializes cache */
 void init_cache();
 
+/* evicts everything and frees the cache, no node may still be pinned */
+void destroy_cache();
+
+/* creates an empty list between two dummy nodes */
+void init_list(Node_t **head, Node_t **tail);
+
 /* inserts node cur after node pos */
 void insert_node(Node_t *cur, Node_t *pos);
 
-/* removes node cur, returns the node before it */
+/* unlinks node cur from its list, returns the node before it */
 Node_t *remove_node(Node_t *cur);
 
 /* moves node cur to the position after node pos */
 void move_node(Node_t *cur, Node_t *pos);
 
-/* finds a node with the given uri from head */
-Node_t *find_node(char *uri, Node_t *head);
+/* drops a reference to node cur, frees it when the last one is gone */
+void release_node(Node_t *cur);
+
+/* evicts node cur from a shard whose write lock is held */
+void evict_node(Shard_t *shard, Node_t *cur);
 
-/* updates cache after accessing a uri */
-void access_node(char *uri);
+/* adds node cur to the hash index of its shard */
+void hash_insert(Node_t *cur);
 
-/* gets the cached response with the given uri if it exists */
-int get_cache(char *uri, char *response);
+/* removes node cur from the hash index of its shard */
+void hash_remove(Node_t *cur);
 
-/* puts (uri, response) into the cache */
+/* finds a node with the given uri and hash in a shard */
+Node_t *find_node(Shard_t *shard, char *uri, unsigned int hash);
+
+/* updates cache after accessing node cur */
+void access_node(Node_t *cur);
+
+/* applies the hits buffered by the calling thread */
+void drain_access();
+
+/*
+ * gets the cached node with the given uri if it exists, the node is
+ * pinned and must be given back with release_node
+ */
+Node_t *get_cache(char *uri);
+
+/*
+ * puts (uri, response) into the cache, returns the pinned node, or NULL
+ * if the object is too large or not admitted
+ */
 Node_t *put_cache(char *uri, char *response, int response_size);
 
 #endif /* __CACHE_H__ */
@@ -0,0 +1,330 @@
+/*
+ * cachesim.c - replays request traces against the cache and reports how
+ * each eviction policy does.
+ *
+ * A workload is a sequence of (uri, size) requests, either read from a
+ * trace file with one "uri size" pair per line or generated: zipf draws
+ * keys with Zipf popularity, scan mixes zipf traffic with long sequential
+ * scans over cold keys. Every request is a get_cache; a miss is followed
+ * by put_cache, as in the proxy. Each policy is run with one thread and
+ * with the requested number of threads.
+ */
+/* $begin cachesim.c */
+#include "cache.h"
+#include "policy.h"
+
+#define SIM_MIN_SIZE 256      /* smallest generated object */
+#define SIM_SCAN_PERCENT 20   /* share of scan requests in the scan workload */
+#define SIM_SCAN_LEN 1000     /* cold keys per scan */
+
+typedef struct Request {
+    char *uri;
+    int size;
+} Request_t;
+
+/* what one replay thread did */
+typedef struct Result {
+    long hits;
+    long misses;
+    long bytes_hit;
+    long bytes_total;
+    unsigned int *latency;  /* ns per get_cache */
+    long n;
+} Result_t;
+
+typedef struct Job {
+    Request_t *requests;
+    long n;        /* requests in the workload */
+    int thread;    /* this thread's index */
+    int threads;   /* threads replaying the workload */
+    Result_t result;
+} Job_t;
+
+static char body[MAX_OBJECT_SIZE];
+
+static void usage(char *prog) {
+    fprintf(stderr, "usage: %s [options]\n", prog);
+    fprintf(stderr, "  -w <workload>  zipf (default), scan or trace\n");
+    fprintf(stderr, "  -f <file>      trace file of \"uri size\" lines, implies -w trace\n");
+    fprintf(stderr, "  -n <ops>       generated requests (default 1000000)\n");
+    fprintf(stderr, "  -k <keys>      distinct generated objects (default 10000)\n");
+    fprintf(stderr, "  -s <alpha>     zipf skew (default 0.9)\n");
+    fprintf(stderr, "  -p <policy>    policy to run, or all (default)\n");
+    fprintf(stderr, "  -a <policy>    admission: all (default) or tinylfu\n");
+    fprintf(stderr, "  -t <threads>   threads for the multi-threaded run (default 4)\n");
+    fprintf(stderr, "  -L             lock-free cache reads\n");
+    exit(1);
+}
+
+static long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* returns a fixed, roughly log-uniform size for generated key k */
+static int key_size(int k) {
+    unsigned int h = (unsigned int)k * 2654435761u;
+    h ^= h >> 16;
+    return (int)(SIM_MIN_SIZE * pow((double)MAX_OBJECT_SIZE / SIM_MIN_SIZE,
+                                    (h % 10000) / 10000.0));
+}
+
+static char *key_uri(int k) {
+    char buf[MAXLINE];
+    sprintf(buf, "http://sim.example/object/%d", k);
+    return strdup(buf);
+}
+
+/* generates n requests over keys with zipf(alpha) popularity, plus scans */
+static Request_t *generate(long n, int keys, double alpha, int scan) {
+    Request_t *requests = (Request_t *)Malloc(n * sizeof(Request_t));
+    double *cdf = (double *)Malloc(keys * sizeof(double));
+    char **uris = (char **)Malloc(keys * sizeof(char *));
+    unsigned int seed = 1;
+    int next_cold = keys;
+    long i;
+    int k;
+
+    cdf[0] = 1.0;
+    for (k = 1; k < keys; k++) {
+        cdf[k] = cdf[k - 1] + 1.0 / pow(k + 1, alpha);
+    }
+    for (k = 0; k < keys; k++) {
+        cdf[k] /= cdf[keys - 1];
+        uris[k] = key_uri(k);
+    }
+
+    for (i = 0; i < n; i++) {
+        /* start scans often enough that SIM_SCAN_PERCENT of requests are in one */
+        if (scan && rand_r(&seed) % ((100 - SIM_SCAN_PERCENT) * SIM_SCAN_LEN) < SIM_SCAN_PERCENT) {
+            /* a run of never repeated keys */
+            int len = SIM_SCAN_LEN;
+            while (len-- > 0 && i < n) {
+                requests[i].uri = key_uri(next_cold);
+                requests[i].size = key_size(next_cold++);
+                i++;
+            }
+            i--;
+            continue;
+        }
+        double u = (double)rand_r(&seed) / RAND_MAX;
+        int lo = 0, hi = keys - 1;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (cdf[mid] < u) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        requests[i].uri = uris[lo];
+        requests[i].size = key_size(lo);
+    }
+    Free(cdf);
+    /* uris[] entries are shared with requests[] and live until exit */
+    Free(uris);
+    return requests;
+}
+
+/* reads a trace of "uri size" lines, exiting on a negative size */
+static Request_t *load_trace(char *path, long *n) {
+    FILE *fp = Fopen(path, "r");
+    char uri[MAXLINE];
+    long cap = 1024;
+    int size;
+    Request_t *requests = (Request_t *)Malloc(cap * sizeof(Request_t));
+
+    *n = 0;
+    while (fscanf(fp, "%8191s %d", uri, &size) == 2) {
+        if (size < 0) {
+            fprintf(stderr, "%s: request %ld: negative size %d\n", path, *n + 1, size);
+            exit(1);
+        }
+        if (*n == cap) {
+            cap *= 2;
+            requests = (Request_t *)Realloc(requests, cap * sizeof(Request_t));
+        }
+        requests[*n].uri = strdup(uri);
+        requests[*n].size = size;
+        (*n)++;
+    }
+    Fclose(fp);
+    return requests;
+}
+
+/* replays every threads-th request starting at the thread's index */
+static void *replay(void *arg) {
+    Job_t *job = (Job_t *)arg;
+    Result_t *result = &job->result;
+    long i;
+
+    result->latency = (unsigned int *)Malloc((job->n / job->threads + 1) * sizeof(unsigned int));
+    for (i = job->thread; i < job->n; i += job->threads) {
+        Request_t *request = &job->requests[i];
+        long start = now_ns();
+        Node_t *node = get_cache(request->uri);
+        result->latency[result->n++] = (unsigned int)(now_ns() - start);
+
+        result->bytes_total += request->size;
+        if (node) {
+            result->hits++;
+            result->bytes_hit += node->size;
+            access_node(node);
+            release_node(node);
+        } else {
+            result->misses++;
+            node = put_cache(request->uri, body, request->size);
+            if (node) {
+                access_node(node);
+                release_node(node);
+            }
+        }
+    }
+    if (cache_lockfree) {
+        drain_access();
+    }
+    return NULL;
+}
+
+static int cmp_latency(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return (x > y) - (x < y);
+}
+
+/* runs one policy with the given number of threads and prints a row */
+static void run(Policy_t *policy, Request_t *requests, long n, int threads) {
+    Job_t *jobs = (Job_t *)Calloc(threads, sizeof(Job_t));
+    pthread_t *tids = (pthread_t *)Malloc(threads * sizeof(pthread_t));
+    Result_t total;
+    unsigned int *latency;
+    long start, elapsed, i, j;
+    int t;
+
+    cache_policy = policy;
+    init_cache();
+
+    start = now_ns();
+    for (t = 0; t < threads; t++) {
+        jobs[t].requests = requests;
+        jobs[t].n = n;
+        jobs[t].thread = t;
+        jobs[t].threads = threads;
+        Pthread_create(&tids[t], NULL, replay, &jobs[t]);
+    }
+    for (t = 0; t < threads; t++) {
+        Pthread_join(tids[t], NULL);
+    }
+    elapsed = now_ns() - start;
+
+    memset(&total, 0, sizeof(total));
+    latency = (unsigned int *)Malloc(n * sizeof(unsigned int));
+    for (t = 0, j = 0; t < threads; t++) {
+        total.hits += jobs[t].result.hits;
+        total.misses += jobs[t].result.misses;
+        total.bytes_hit += jobs[t].result.bytes_hit;
+        total.bytes_total += jobs[t].result.bytes_total;
+        for (i = 0; i < jobs[t].result.n; i++) {
+            latency[j++] = jobs[t].result.latency[i];
+        }
+        Free(jobs[t].result.latency);
+    }
+    qsort(latency, j, sizeof(unsigned int), cmp_latency);
+
+    printf("%-8s %-8s %7d %9.2f %9.2f %12.0f %9u\n", policy->name,
+           cache_admission == ADMIT_TINYLFU ? "tinylfu" : "all", threads,
+           100.0 * total.hits / (total.hits + total.misses),
+           100.0 * total.bytes_hit / total.bytes_total,
+           n / (elapsed / 1e9), j ? latency[j * 99 / 100] : 0);
+
+    destroy_cache();
+    Free(latency);
+    Free(tids);
+    Free(jobs);
+}
+
+int main(int argc, char **argv) {
+    char *workload = "zipf", *trace = NULL, *policy_name = "all";
+    long n = 1000000;
+    int keys = 10000, threads = 4, opt, i;
+    double alpha = 0.9;
+    Request_t *requests;
+
+    while ((opt = getopt(argc, argv, "w:f:n:k:s:p:a:t:L")) != -1) {
+        switch (opt) {
+        case 'w':
+            workload = optarg;
+            break;
+        case 'f':
+            workload = "trace";
+            trace = optarg;
+            break;
+        case 'n':
+            n = atol(optarg);
+            break;
+        case 'k':
+            keys = atoi(optarg);
+            break;
+        case 's':
+            alpha = atof(optarg);
+            break;
+        case 'p':
+            policy_name = optarg;
+            break;
+        case 'a':
+            if (!strcasecmp(optarg, "all")) {
+                cache_admission = ADMIT_ALL;
+            } else if (!strcasecmp(optarg, "tinylfu")) {
+                cache_admission = ADMIT_TINYLFU;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'L':
+            cache_lockfree = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (n <= 0 || keys <= 0 || threads <= 0) {
+        usage(argv[0]);
+    }
+    if (strcasecmp(policy_name, "all") && find_policy(policy_name) == NULL) {
+        usage(argv[0]);
+    }
+
+    if (!strcasecmp(workload, "trace")) {
+        if (trace == NULL) {
+            usage(argv[0]);
+        }
+        requests = load_trace(trace, &n);
+    } else if (!strcasecmp(workload, "zipf")) {
+        requests = generate(n, keys, alpha, 0);
+    } else if (!strcasecmp(workload, "scan")) {
+        requests = generate(n, keys, alpha, 1);
+    } else {
+        usage(argv[0]);
+        return 1;
+    }
+    memset(body, 'x', sizeof(body));
+
+    printf("workload %s, %ld requests, cache %d bytes\n", workload, n, MAX_CACHE_SIZE);
+    printf("%-8s %-8s %7s %9s %9s %12s %9s\n", "policy", "admit", "threads",
+           "hit%", "bytehit%", "ops/sec", "p99(ns)");
+    for (i = 0; policy_list[i] != NULL; i++) {
+        if (strcasecmp(policy_name, "all") && strcasecmp(policy_name, policy_list[i]->name)) {
+            continue;
+        }
+        run(policy_list[i], requests, n, 1);
+        if (threads > 1) {
+            run(policy_list[i], requests, n, threads);
+        }
+    }
+    return 0;
+}
+
+/* $end cachesim.c */
@@ -0,0 +1,192 @@
+/*
+ * connect.c - connections to origins under timeouts.
+ *
+ * The addresses of an origin are tried with non-blocking connects,
+ * alternating between address families the way Happy Eyeballs does: the
+ * first attempt gets ATTEMPT_DELAY milliseconds, then the next one starts
+ * alongside it, and so on; the first to complete wins and the rest are
+ * closed. An attempt that fails outright starts the next at once. No
+ * attempt outlives connect_timeout or the request's deadline, so an
+ * unreachable address cannot pin a worker for the kernel's timeout.
+ */
+/* $begin connect.c */
+#include "connect.h"
+#include <poll.h>
+
+long connect_timeout = CONNECT_TIMEOUT;
+long request_timeout = REQUEST_TIMEOUT;
+long read_timeout = READ_TIMEOUT;
+
+/* returns the current time in milliseconds */
+long now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* orders addrs alternating address families, starting with the first one's */
+void interleave_addrs(Dns_addr_t *addrs, int n) {
+    Dns_addr_t sorted[DNS_MAX_ADDRS];
+    int used[DNS_MAX_ADDRS] = {0};
+    int i, k, family = addrs[0].family;
+
+    for (k = 0; k < n; k++) {
+        /* the next unused address of the wanted family, else any */
+        for (i = 0; i < n && (used[i] || addrs[i].family != family); i++) {
+        }
+        if (i == n) {
+            for (i = 0; used[i]; i++) {
+            }
+        }
+        used[i] = 1;
+        sorted[k] = addrs[i];
+        family = (addrs[i].family == AF_INET6) ? AF_INET : AF_INET6;
+    }
+    memcpy(addrs, sorted, n * sizeof(Dns_addr_t));
+}
+
+/* starts a non-blocking connect, returns the descriptor or -1 */
+static int start_attempt(Dns_addr_t *addr, int *done) {
+    int fd;
+
+    if ((fd = socket(addr->family, addr->socktype | SOCK_NONBLOCK, addr->protocol)) < 0) {
+        return -1;
+    }
+    if (connect(fd, (SA *)&addr->addr, addr->addrlen) == 0) {
+        *done = 1;
+        return fd;
+    }
+    if (errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    *done = 0;
+    return fd;
+}
+
+/*
+ * connects to host:port before deadline (milliseconds, from now_ms) and
+ * within connect_timeout, racing its addresses Happy Eyeballs style;
+ * returns a blocking descriptor or -1, with errno ETIMEDOUT if the time
+ * ran out
+ */
+int connect_host(char *host, char *port, long deadline) {
+    Dns_addr_t addrs[DNS_MAX_ADDRS];
+    struct pollfd pending[DNS_MAX_ADDRS];
+    int n, next = 0, npending = 0, i, fd, done, err, winner = -1;
+    long now = now_ms(), end, next_start = now, wait;
+    socklen_t len;
+
+    if ((n = dns_resolve(host, port, addrs, DNS_MAX_ADDRS)) < 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    interleave_addrs(addrs, n);
+    end = (now + connect_timeout < deadline) ? now + connect_timeout : deadline;
+
+    while (winner < 0 && now < end && (next < n || npending > 0)) {
+        if (next < n && (npending == 0 || now >= next_start)) {
+            if ((fd = start_attempt(&addrs[next++], &done)) >= 0) {
+                if (done) {
+                    winner = fd;
+                    break;
+                }
+                pending[npending].fd = fd;
+                pending[npending].events = POLLOUT;
+                npending++;
+                next_start = now + ATTEMPT_DELAY;
+            } else {
+                next_start = now;
+            }
+            continue;
+        }
+
+        wait = end - now;
+        if (next < n && next_start - now < wait) {
+            wait = next_start - now;
+        }
+        if (poll(pending, npending, wait) < 0 && errno != EINTR) {
+            break;
+        }
+        for (i = 0; i < npending && winner < 0; i++) {
+            if (pending[i].revents == 0) {
+                continue;
+            }
+            err = 0;
+            len = sizeof(err);
+            getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err == 0) {
+                winner = pending[i].fd;
+            } else {
+                /* failed, start the next address right away */
+                close(pending[i].fd);
+                pending[i--] = pending[--npending];
+                next_start = now;
+            }
+        }
+        now = now_ms();
+    }
+
+    for (i = 0; i < npending; i++) {
+        if (pending[i].fd != winner) {
+            close(pending[i].fd);
+        }
+    }
+    if (winner >= 0) {
+        fcntl(winner, F_SETFL, fcntl(winner, F_GETFL, 0) & ~O_NONBLOCK);
+    } else {
+        errno = (now >= end) ? ETIMEDOUT : ECONNREFUSED;
+    }
+    return winner;
+}
+
+/*
+ * deadline_init - starts a deadline at on fd, to be armed before the
+ * first blocking call
+ */
+void deadline_init(Deadline_t *d, int fd, long at) {
+    d->fd = fd;
+    d->at = at;
+    d->armed = 0;
+    d->idle = 0;
+}
+
+/*
+ * deadline_arm - bounds the next blocking call on the socket by the
+ * deadline, returns -1 if it has passed. The timeouts are relative to
+ * the start of each call, so one armed with the time left lets a later
+ * call run past the deadline by the time gone since; they are only set
+ * again once that could exceed DEADLINE_SLACK, not on every call
+ */
+int deadline_arm(Deadline_t *d) {
+    struct timeval tv;
+    long left;
+
+    if (d->idle > 0) {
+        /* the socket timeouts start over with each call, so set once */
+        left = d->idle;
+    } else if ((left = d->at - now_ms()) <= 0) {
+        return -1;
+    }
+    if (d->armed == 0 || d->armed - left > DEADLINE_SLACK) {
+        tv.tv_sec = left / 1000;
+        tv.tv_usec = (left % 1000) * 1000;
+        setsockopt(d->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(d->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        d->armed = left;
+    }
+    return 0;
+}
+
+/*
+ * deadline_idle - lifts the deadline once the origin has answered, so a
+ * long body is not cut off; each later call may wait idle milliseconds
+ * for progress instead
+ */
+void deadline_idle(Deadline_t *d, long idle) {
+    d->idle = idle;
+    d->armed = 0;
+}
+
+/* $end connect.c */
@@ -0,0 +1,62 @@
+/*
+ * connect.h - connections to origins under timeouts, definition and
+ * prototypes.
+ */
+/* $begin connect.h */
+#ifndef __CONNECT_H__
+#define __CONNECT_H__
+
+#include "csapp.h"
+#include "dns.h"
+
+#define CONNECT_TIMEOUT 3000   /* default connect timeout, milliseconds */
+#define REQUEST_TIMEOUT 30000  /* default deadline of an origin's response head, milliseconds */
+#define READ_TIMEOUT 10000     /* default wait for each read of a response body, milliseconds */
+#define ATTEMPT_DELAY 250      /* milliseconds before racing the next address */
+#define DEADLINE_SLACK 50      /* milliseconds a blocking call may overrun a deadline */
+
+/*
+ * a deadline on the blocking calls of one socket, applied as its send
+ * and receive timeouts
+ */
+typedef struct Deadline {
+    int fd;
+    long at;     /* milliseconds, from now_ms */
+    long armed;  /* timeout set on fd, milliseconds, 0 if not set yet */
+    long idle;   /* once not 0, milliseconds each call may wait instead */
+} Deadline_t;
+
+extern long connect_timeout;
+extern long request_timeout;
+extern long read_timeout;
+
+/* function prototypes */
+
+/* returns the current time in milliseconds */
+long now_ms();
+
+/* orders addrs alternating address families, starting with the first one's */
+void interleave_addrs(Dns_addr_t *addrs, int n);
+
+/*
+ * connects to host:port before deadline (milliseconds, from now_ms) and
+ * within connect_timeout, racing its addresses Happy Eyeballs style;
+ * returns a blocking descriptor or -1, with errno ETIMEDOUT if the time
+ * ran out
+ */
+int connect_host(char *host, char *port, long deadline);
+
+/* starts a deadline at (milliseconds, from now_ms) on fd, not armed yet */
+void deadline_init(Deadline_t *d, int fd, long at);
+
+/*
+ * before a blocking call on its socket: bounds the call by the deadline,
+ * within DEADLINE_SLACK; returns -1 if it has passed
+ */
+int deadline_arm(Deadline_t *d);
+
+/* lifts the deadline, each later call on the socket may wait idle milliseconds */
+void deadline_idle(Deadline_t *d, long idle);
+
+#endif /* __CONNECT_H__ */
+/* $end connect.h */
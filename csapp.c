@@ -22,7 +22,7 @@ void posix_error(int code, char *msg) /* Posix-style error */
     exit(0);
 }
 
-void gai_error(int code, char *msg) /* Getaddrinfo-style error */
+void addrinfo_error(int code, char *msg) /* Getaddrinfo-style error */
 {
     fprintf(stderr, "%s: %s\n", msg, gai_strerror(code));
     exit(0);
@@ -577,7 +577,7 @@ void Getaddrinfo(const char *node, const char *service,
     int rc;
 
     if ((rc = getaddrinfo(node, service, hints, res)) != 0) 
-        gai_error(rc, "Getaddrinfo error");
+        addrinfo_error(rc, "Getaddrinfo error");
 }
 /* $end getaddrinfo */
 
@@ -588,7 +588,7 @@ void Getnameinfo(const struct sockaddr *sa, socklen_t salen, char *host,
 
     if ((rc = getnameinfo(sa, salen, host, hostlen, serv, 
                           servlen, flags)) != 0) 
-        gai_error(rc, "Getnameinfo error");
+        addrinfo_error(rc, "Getnameinfo error");
 }
 
 void Freeaddrinfo(struct addrinfo *res)
@@ -837,34 +837,91 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $end rio_readnb */
 
 /* 
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readlineb - Robustly read a text line (buffered). The internal
+ *     buffer is scanned for the newline with memchr and copied out in one
+ *     piece instead of a byte at a time.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
+    size_t n = 0, cnt;
+    char *bufp = usrbuf, *nl = NULL;
 
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
+    while (n + 1 < maxlen && nl == NULL) {
+        while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
+            rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+            if (rp->rio_cnt < 0) {
+                if (errno != EINTR) /* Interrupted by sig handler return */
+                    return -1;      /* Error */
             }
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* Error */
+            else if (rp->rio_cnt == 0) {
+                *bufp = 0;
+                return n;           /* EOF, n bytes were read */
+            }
+            else 
+                rp->rio_bufptr = rp->rio_buf;
+        }
+
+        cnt = maxlen - 1 - n;
+        if (rp->rio_cnt < cnt)
+            cnt = rp->rio_cnt;
+        if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+            cnt = nl - rp->rio_bufptr + 1;
+        memcpy(bufp + n, rp->rio_bufptr, cnt);
+        rp->rio_bufptr += cnt;
+        rp->rio_cnt -= cnt;
+        n += cnt;
     }
-    *bufp = 0;
-    return n-1;
+    bufp[n] = 0;
+    return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_readlinep - Robustly read a text line (buffered) without copying it.
+ *     *linep is set to the line inside the internal buffer, including its
+ *     newline and not null terminated; it stays valid until the next read
+ *     from rp. A line longer than the buffer comes back in buffer sized
+ *     pieces. Returns the line length, 0 on EOF or -1 on error.
+ */
+/* $begin rio_readlinep */
+ssize_t rio_readlinep(rio_t *rp, char **linep) 
+{
+    char *nl, *end;
+    ssize_t rc, n, scanned = 0;
+
+    if (rp->rio_cnt < 0)
+        rp->rio_cnt = 0;
+    while ((nl = memchr(rp->rio_bufptr + scanned, '\n', rp->rio_cnt - scanned)) == NULL) {
+        scanned = rp->rio_cnt;
+        end = rp->rio_buf + sizeof(rp->rio_buf);
+        if (rp->rio_bufptr + rp->rio_cnt == end) {
+            if (rp->rio_bufptr == rp->rio_buf)
+                break;  /* the line fills the whole buffer */
+            /* Move the partial line to the front to make room */
+            memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+            rp->rio_bufptr = rp->rio_buf;
+        }
+        rc = read(rp->rio_fd, rp->rio_bufptr + rp->rio_cnt,
+                  end - (rp->rio_bufptr + rp->rio_cnt));
+        if (rc < 0) {
+            if (errno != EINTR) /* Interrupted by sig handler return */
+                return -1;      /* Error */
+        }
+        else if (rc == 0)
+            break;              /* EOF */
+        else
+            rp->rio_cnt += rc;
+    }
+
+    n = (nl != NULL) ? nl - rp->rio_bufptr + 1 : rp->rio_cnt;
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+    return n;
+}
+/* $end rio_readlinep */
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -897,6 +954,15 @@ ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n)
     return rc;
 }
 
+ssize_t Rio_readlinep(rio_t *rp, char **linep) 
+{
+    ssize_t rc;
+
+    if ((rc = rio_readlinep(rp, linep)) < 0)
+	unix_error("Rio_readlinep error");
+    return rc;
+} 
+
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
     ssize_t rc;
@@ -967,6 +1033,16 @@ int open_clientfd(char *hostname, char *port) {
  */
 /* $begin open_listenfd */
 int open_listenfd(char *port) 
+{
+    return open_listenfd_opt(port, 0);
+}
+
+/*
+ * open_listenfd_opt - Like open_listenfd, but with reuseport set every
+ *     socket opened this way gets SO_REUSEPORT, so several of them can
+ *     listen on the same port and the kernel spreads connections over them.
+ */
+int open_listenfd_opt(char *port, int reuseport) 
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
@@ -990,6 +1066,9 @@ int open_listenfd(char *port)
         /* Eliminates "Address already in use" error from bind */
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
+        if (reuseport)
+            setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                       (const void *)&optval , sizeof(int));
 
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
@@ -1036,6 +1115,15 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_listenfd_opt(char *port, int reuseport) 
+{
+    int rc;
+
+    if ((rc = open_listenfd_opt(port, reuseport)) < 0)
+	unix_error("Open_listenfd_opt error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
@@ -0,0 +1,311 @@
+/*
+ * dns.c - in-process cache of origin address lookups.
+ *
+ * Entries are found through a hash table under one mutex; getaddrinfo
+ * itself runs outside of it, so a slow lookup only blocks its caller.
+ * A successful lookup is used for DNS_TTL seconds and a failed one is
+ * remembered for DNS_NEG_TTL. When a refresh fails, the expired
+ * addresses keep answering for up to DNS_STALE_TTL more seconds, with a
+ * new lookup tried every DNS_RETRY. Once DNS_MAX_ENTRIES are kept, a new
+ * entry takes the place of the one that expired first, which is the one
+ * least recently looked up unless its lookup failed; a binary min-heap on
+ * the expiry time finds it in O(log n).
+ *
+ * The event engines cannot block in getaddrinfo, so dns_resolve_async
+ * answers from the cache or queues the lookup for DNS_RESOLVERS threads
+ * that call back when it is done.
+ */
+/* $begin dns.c */
+#include "dns.h"
+#include "hash.h"
+
+static Dns_entry_t *dns_table[DNS_BUCKETS];
+static Dns_entry_t *dns_heap[DNS_MAX_ENTRIES];  /* entries by expiry, earliest first */
+static int dns_entries;
+static Dns_stats_t counters;
+static pthread_mutex_t dns_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define DNS_MISS -2  /* no usable entry, getaddrinfo has to be asked */
+
+/* lookups waiting for a resolver thread */
+static Dns_job_t *jobs_head, *jobs_tail;
+static pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t resolvers_once = PTHREAD_ONCE_INIT;
+
+/* initializes the cache */
+void init_dns() {
+    memset(dns_table, 0, sizeof(dns_table));
+    memset(&counters, 0, sizeof(counters));
+    dns_entries = 0;
+}
+
+/* finds the entry of host:port, dns_mutex must be held */
+static Dns_entry_t *find_entry(char *host, char *port, unsigned int hash) {
+    Dns_entry_t *entry;
+
+    for (entry = dns_table[hash & (DNS_BUCKETS - 1)]; entry != NULL;
+         entry = entry->hnext) {
+        if (entry->hash == hash && !strcasecmp(entry->host, host) &&
+            !strcmp(entry->port, port)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* puts entry at slot i of dns_heap */
+static void heap_place(Dns_entry_t *entry, int i) {
+    dns_heap[i] = entry;
+    entry->heap_index = i;
+}
+
+/* moves the entry at slot i of dns_heap up or down to where its expiry belongs */
+static void heap_fix(int i) {
+    Dns_entry_t *entry = dns_heap[i];
+    int child;
+
+    while (i > 0 && entry->expires < dns_heap[(i - 1) / 2]->expires) {
+        heap_place(dns_heap[(i - 1) / 2], i);
+        i = (i - 1) / 2;
+    }
+    while ((child = 2 * i + 1) < dns_entries) {
+        if (child + 1 < dns_entries &&
+            dns_heap[child + 1]->expires < dns_heap[child]->expires) {
+            child++;
+        }
+        if (dns_heap[child]->expires >= entry->expires) {
+            break;
+        }
+        heap_place(dns_heap[child], i);
+        i = child;
+    }
+    heap_place(entry, i);
+}
+
+/* changes when entry expires, dns_mutex must be held */
+static void set_expires(Dns_entry_t *entry, time_t expires) {
+    entry->expires = expires;
+    heap_fix(entry->heap_index);
+}
+
+/*
+ * unlinks the entry that expired first from the table and the heap;
+ * dns_mutex must be held and the table not be empty
+ */
+static Dns_entry_t *evict_entry() {
+    Dns_entry_t **link, *entry = dns_heap[0];
+
+    if (--dns_entries > 0) {
+        heap_place(dns_heap[dns_entries], 0);
+        heap_fix(0);
+    }
+    for (link = &dns_table[entry->hash & (DNS_BUCKETS - 1)]; *link != entry;
+         link = &(*link)->hnext) {
+    }
+    *link = entry->hnext;
+    free(entry->host);
+    free(entry->port);
+    return entry;
+}
+
+/*
+ * adds an empty entry for host:port, in place of an old one if the table
+ * is full; dns_mutex must be held
+ */
+static Dns_entry_t *add_entry(char *host, char *port, unsigned int hash) {
+    Dns_entry_t *entry;
+
+    if (dns_entries >= DNS_MAX_ENTRIES) {
+        entry = evict_entry();
+        memset(entry, 0, sizeof(Dns_entry_t));
+    } else {
+        entry = (Dns_entry_t *)Calloc(1, sizeof(Dns_entry_t));
+    }
+    entry->host = strdup(host);
+    entry->port = strdup(port);
+    entry->hash = hash;
+    entry->hnext = dns_table[hash & (DNS_BUCKETS - 1)];
+    dns_table[hash & (DNS_BUCKETS - 1)] = entry;
+    heap_place(entry, dns_entries++);
+    heap_fix(entry->heap_index);
+    return entry;
+}
+
+/* copies up to max addresses of an entry, returns their number or -1 */
+static int copy_addrs(Dns_entry_t *entry, Dns_addr_t *addrs, int max) {
+    int n = entry->naddrs < max ? entry->naddrs : max;
+
+    memcpy(addrs, entry->addrs, n * sizeof(Dns_addr_t));
+    return n > 0 ? n : -1;
+}
+
+/* resolves host:port with getaddrinfo, returns the number of addresses */
+static int lookup(char *host, char *port, Dns_addr_t *addrs) {
+    struct addrinfo hints, *listp, *p;
+    int n = 0;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(host, port, &hints, &listp) != 0) {
+        return 0;
+    }
+    for (p = listp; p && n < DNS_MAX_ADDRS; p = p->ai_next) {
+        if (p->ai_addrlen > sizeof(struct sockaddr_storage)) {
+            continue;
+        }
+        addrs[n].family = p->ai_family;
+        addrs[n].socktype = p->ai_socktype;
+        addrs[n].protocol = p->ai_protocol;
+        addrs[n].addrlen = p->ai_addrlen;
+        memcpy(&addrs[n].addr, p->ai_addr, p->ai_addrlen);
+        n++;
+    }
+    freeaddrinfo(listp);
+    return n;
+}
+
+/*
+ * answers host:port from a fresh entry like dns_resolve, or returns
+ * DNS_MISS; dns_mutex must be held
+ */
+static int cached(char *host, char *port, unsigned int hash, Dns_addr_t *addrs,
+        int max, time_t now) {
+    Dns_entry_t *entry;
+
+    if ((entry = find_entry(host, port, hash)) == NULL || now >= entry->expires) {
+        return DNS_MISS;
+    }
+    if (entry->stale) {
+        counters.stale++;
+    } else if (entry->naddrs > 0) {
+        counters.hits++;
+    } else {
+        counters.negative_hits++;
+    }
+    return copy_addrs(entry, addrs, max);
+}
+
+/*
+ * finds the addresses of host:port, copying up to max of them to addrs;
+ * returns their number or -1 if the host cannot be resolved
+ */
+int dns_resolve(char *host, char *port, Dns_addr_t *addrs, int max) {
+    unsigned int hash = hash_str(host) ^ hash_str(port);
+    Dns_addr_t found[DNS_MAX_ADDRS];
+    Dns_entry_t *entry;
+    time_t now = time(NULL);
+    int n;
+
+    pthread_mutex_lock(&dns_mutex);
+    if ((n = cached(host, port, hash, addrs, max, now)) != DNS_MISS) {
+        pthread_mutex_unlock(&dns_mutex);
+        return n;
+    }
+    counters.misses++;
+    pthread_mutex_unlock(&dns_mutex);
+
+    n = lookup(host, port, found);
+
+    pthread_mutex_lock(&dns_mutex);
+    if ((entry = find_entry(host, port, hash)) == NULL) {
+        entry = add_entry(host, port, hash);
+    }
+    if (n > 0) {
+        memcpy(entry->addrs, found, n * sizeof(Dns_addr_t));
+        entry->naddrs = n;
+        set_expires(entry, now + DNS_TTL);
+        entry->stale_until = entry->expires + DNS_STALE_TTL;
+        entry->stale = 0;
+        pthread_mutex_unlock(&dns_mutex);
+        n = n < max ? n : max;
+        memcpy(addrs, found, n * sizeof(Dns_addr_t));
+        return n;
+    }
+    if (entry->naddrs > 0 && now < entry->stale_until) {
+        /* stale if error, without a lookup per request until the retry */
+        counters.stale++;
+        entry->stale = 1;
+        set_expires(entry, (now + DNS_RETRY < entry->stale_until) ?
+                           now + DNS_RETRY : entry->stale_until);
+        n = copy_addrs(entry, addrs, max);
+        pthread_mutex_unlock(&dns_mutex);
+        return n;
+    }
+    entry->naddrs = 0;
+    set_expires(entry, now + DNS_NEG_TTL);
+    entry->stale = 0;
+    pthread_mutex_unlock(&dns_mutex);
+    return -1;
+}
+
+/* does queued lookups forever */
+static void *resolver(void *arg) {
+    Dns_job_t *job;
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        pthread_mutex_lock(&jobs_mutex);
+        while (jobs_head == NULL) {
+            pthread_cond_wait(&jobs_cond, &jobs_mutex);
+        }
+        job = jobs_head;
+        if ((jobs_head = job->next) == NULL) {
+            jobs_tail = NULL;
+        }
+        pthread_mutex_unlock(&jobs_mutex);
+
+        job->naddrs = dns_resolve(job->host, job->port, job->addrs, DNS_MAX_ADDRS);
+        job->done(job);
+    }
+    return NULL;
+}
+
+static void start_resolvers() {
+    pthread_t tid;
+    int i;
+
+    for (i = 0; i < DNS_RESOLVERS; i++) {
+        Pthread_create(&tid, NULL, resolver, NULL);
+    }
+}
+
+/*
+ * answers job from the cache and returns 1 without blocking, or returns
+ * 0 and has a resolver thread look it up and call job->done
+ */
+int dns_resolve_async(Dns_job_t *job) {
+    unsigned int hash = hash_str(job->host) ^ hash_str(job->port);
+    int n;
+
+    pthread_mutex_lock(&dns_mutex);
+    n = cached(job->host, job->port, hash, job->addrs, DNS_MAX_ADDRS, time(NULL));
+    pthread_mutex_unlock(&dns_mutex);
+    if (n != DNS_MISS) {
+        job->naddrs = n;
+        return 1;
+    }
+
+    pthread_once(&resolvers_once, start_resolvers);
+    job->next = NULL;
+    pthread_mutex_lock(&jobs_mutex);
+    if (jobs_tail != NULL) {
+        jobs_tail->next = job;
+    } else {
+        jobs_head = job;
+    }
+    jobs_tail = job;
+    pthread_cond_signal(&jobs_cond);
+    pthread_mutex_unlock(&jobs_mutex);
+    return 0;
+}
+
+/* copies the lookup counters */
+void dns_stats(Dns_stats_t *stats) {
+    pthread_mutex_lock(&dns_mutex);
+    *stats = counters;
+    pthread_mutex_unlock(&dns_mutex);
+}
+
+/* $end dns.c */
@@ -0,0 +1,83 @@
+/*
+ * dns.h - in-process cache of origin address lookups, definition and
+ * prototypes.
+ */
+/* $begin dns.h */
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "csapp.h"
+
+#define DNS_BUCKETS 256
+#define DNS_MAX_ENTRIES 4096  /* entries kept, past it the first to expire makes room */
+#define DNS_MAX_ADDRS 8       /* addresses kept per entry */
+#define DNS_TTL 60            /* seconds a successful lookup is used */
+#define DNS_NEG_TTL 5         /* seconds a failed lookup is remembered */
+#define DNS_STALE_TTL 600     /* seconds past DNS_TTL it may serve if lookups fail */
+#define DNS_RETRY 5           /* seconds a stale entry serves before the next lookup */
+#define DNS_RESOLVERS 4       /* threads doing lookups for dns_resolve_async */
+
+/* one address of an origin, as getaddrinfo returned it */
+typedef struct Dns_addr {
+    int family;
+    int socktype;
+    int protocol;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+} Dns_addr_t;
+
+/* the addresses of a (host, port), none for a failed lookup */
+typedef struct Dns_entry {
+    struct Dns_entry *hnext;  /* next entry in the same bucket */
+    char *host;
+    char *port;
+    unsigned int hash;
+    time_t expires;           /* when the next lookup is due */
+    int heap_index;           /* slot in the expiry heap */
+    time_t stale_until;       /* when the addresses stop serving if lookups fail */
+    int stale;                /* the last lookup failed, the addresses are kept */
+    int naddrs;
+    Dns_addr_t addrs[DNS_MAX_ADDRS];
+} Dns_entry_t;
+
+/* a lookup handed to the resolver threads */
+typedef struct Dns_job {
+    char host[MAXLINE];
+    char port[MAXLINE];
+    Dns_addr_t addrs[DNS_MAX_ADDRS];
+    int naddrs;                      /* the answer, -1 if host cannot be resolved */
+    void (*done)(struct Dns_job *);  /* called on a resolver thread with the answer */
+    void *arg;
+    struct Dns_job *next;
+} Dns_job_t;
+
+/* lookup counters */
+typedef struct Dns_stats {
+    unsigned long hits;           /* answered from a fresh entry */
+    unsigned long negative_hits;  /* answered from a remembered failure */
+    unsigned long misses;         /* went to getaddrinfo */
+    unsigned long stale;          /* answered from the addresses of a failed refresh */
+} Dns_stats_t;
+
+/* function prototypes */
+
+/* initializes the cache */
+void init_dns();
+
+/*
+ * finds the addresses of host:port, copying up to max of them to addrs;
+ * returns their number or -1 if the host cannot be resolved
+ */
+int dns_resolve(char *host, char *port, Dns_addr_t *addrs, int max);
+
+/*
+ * answers job from the cache and returns 1 without blocking, or returns
+ * 0 and has a resolver thread look it up and call job->done
+ */
+int dns_resolve_async(Dns_job_t *job);
+
+/* copies the lookup counters */
+void dns_stats(Dns_stats_t *stats);
+
+#endif /* __DNS_H__ */
+/* $end dns.h */
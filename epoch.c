@@ -0,0 +1,137 @@
+/*
+ * epoch.c - epoch-based memory reclamation for lock-free readers.
+ *
+ * A reader publishes the global epoch it saw before touching shared
+ * pointers. Retired memory is stamped with the global epoch, which is then
+ * advanced, and is freed once every active reader has moved past it.
+ */
+/* $begin epoch.c */
+#include "epoch.h"
+
+static volatile unsigned long global_epoch = 1;
+
+/* all epoch records, never freed, reused after their thread exits */
+static Epoch_t *volatile records;
+static sem_t records_mutex;
+
+/* retired memory, oldest last */
+static Retired_t *retired;
+static sem_t retired_mutex;
+
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static pthread_key_t epoch_key;
+static void (*epoch_exit_fn)(Epoch_t *rec);
+
+/* releases the record of an exiting thread */
+static void epoch_thread_exit(void *arg) {
+    Epoch_t *rec = (Epoch_t *)arg;
+    if (epoch_exit_fn != NULL) {
+        epoch_exit_fn(rec);
+    }
+    rec->active = 0;
+    rec->data = NULL;
+    __atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void epoch_init() {
+    Sem_init(&records_mutex, 0, 1);
+    Sem_init(&retired_mutex, 0, 1);
+    pthread_key_create(&epoch_key, epoch_thread_exit);
+}
+
+/* returns the epoch record of the calling thread, registering it if needed */
+Epoch_t *epoch_self() {
+    static __thread Epoch_t *self;
+    Epoch_t *rec;
+
+    if (self != NULL) {
+        return self;
+    }
+    pthread_once(&epoch_once, epoch_init);
+
+    /* reuse the record of an exited thread if there is one */
+    for (rec = records; rec != NULL; rec = rec->next) {
+        if (!rec->in_use && __sync_bool_compare_and_swap(&rec->in_use, 0, 1)) {
+            break;
+        }
+    }
+    if (rec == NULL) {
+        rec = (Epoch_t *)Calloc(1, sizeof(Epoch_t));
+        rec->in_use = 1;
+        P(&records_mutex);
+        rec->next = records;
+        __atomic_store_n(&records, rec, __ATOMIC_RELEASE);
+        V(&records_mutex);
+    }
+    pthread_setspecific(epoch_key, rec);
+    self = rec;
+    return rec;
+}
+
+/* sets a function called with the record when its thread exits */
+void epoch_set_exit(void (*exit_fn)(Epoch_t *rec)) {
+    epoch_exit_fn = exit_fn;
+}
+
+/* enters a read-side critical section */
+void epoch_enter() {
+    Epoch_t *rec = epoch_self();
+    __atomic_store_n(&rec->epoch, global_epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&rec->active, 1, __ATOMIC_SEQ_CST);
+    __sync_synchronize();
+}
+
+/* leaves a read-side critical section */
+void epoch_exit() {
+    __atomic_store_n(&epoch_self()->active, 0, __ATOMIC_RELEASE);
+}
+
+/* frees ptr once no reader that could have seen it is left */
+void epoch_retire(void *ptr) {
+    Retired_t *item = (Retired_t *)Malloc(sizeof(Retired_t));
+    item->ptr = ptr;
+    item->epoch = __sync_fetch_and_add(&global_epoch, 1);
+
+    P(&retired_mutex);
+    item->next = retired;
+    retired = item;
+    V(&retired_mutex);
+
+    epoch_reclaim();
+}
+
+/* frees retired memory that no reader can see any more */
+void epoch_reclaim() {
+    unsigned long min_epoch = global_epoch;
+    Epoch_t *rec;
+    Retired_t **pos, *item, *done = NULL;
+
+    __sync_synchronize();
+    for (rec = records; rec != NULL; rec = rec->next) {
+        if (rec->active && rec->epoch < min_epoch) {
+            min_epoch = rec->epoch;
+        }
+    }
+
+    P(&retired_mutex);
+    pos = &retired;
+    while ((item = *pos) != NULL) {
+        if (item->epoch < min_epoch) {
+            *pos = item->next;
+            item->next = done;
+            done = item;
+        } else {
+            pos = &item->next;
+        }
+    }
+    V(&retired_mutex);
+
+    while (done != NULL) {
+        item = done;
+        done = item->next;
+        Free(item->ptr);
+        Free(item);
+    }
+}
+
+/* $end epoch.c */
@@ -0,0 +1,48 @@
+/*
+ * epoch.h - epoch-based memory reclamation for lock-free readers,
+ * definition and prototypes.
+ */
+/* $begin epoch.h */
+#ifndef __EPOCH_H__
+#define __EPOCH_H__
+
+#include "csapp.h"
+
+/* per-thread epoch record */
+typedef struct Epoch {
+    volatile unsigned long epoch;  /* global epoch seen on entry */
+    volatile int active;           /* 1 inside a read-side critical section */
+    volatile int in_use;           /* 0 once its thread has exited */
+    void *data;                    /* per-thread data of the record's owner */
+    struct Epoch *next;
+} Epoch_t;
+
+/* memory waiting for all readers that may still see it to leave */
+typedef struct Retired {
+    void *ptr;
+    unsigned long epoch;
+    struct Retired *next;
+} Retired_t;
+
+/* function prototypes */
+
+/* returns the epoch record of the calling thread, registering it if needed */
+Epoch_t *epoch_self();
+
+/* sets a function called with the record when its thread exits */
+void epoch_set_exit(void (*exit_fn)(Epoch_t *rec));
+
+/* enters a read-side critical section */
+void epoch_enter();
+
+/* leaves a read-side critical section */
+void epoch_exit();
+
+/* frees ptr once no reader that could have seen it is left */
+void epoch_retire(void *ptr);
+
+/* frees retired memory that no reader can see any more */
+void epoch_reclaim();
+
+#endif /* __EPOCH_H__ */
+/* $end epoch.h */
@@ -0,0 +1,854 @@
+/*
+ * event.c - epoll based event-driven connection engine for the web proxy.
+ *
+ * Every descriptor is non-blocking and every connection is a small state
+ * machine driven by readiness events instead of a thread:
+ *
+ *   ST_REQUEST  read the request head from the client
+ *   ST_RESOLVE  wait for a resolver thread to look up the origin
+ *   ST_CONNECT  wait for the non-blocking connect to the origin
+ *   ST_FORWARD  send the request to the origin
+ *   ST_RELAY    copy the response to the client, keeping a copy for the cache
+ *   ST_HIT      send a pinned cached response
+ *   ST_ERROR    send an error response, or the statistics
+ *
+ * While the origin is ahead of the client, reading from the origin pauses
+ * until the client has taken the buffered bytes.
+ *
+ * Every state but the last has a deadline, kept in a min-heap per reactor
+ * whose earliest entry bounds epoll_wait: the request head has to arrive
+ * within the client idle timeout, the origin addresses are tried in turn
+ * within connect_timeout, each getting an equal share of what is left,
+ * and the origin has to start answering within request_timeout. An
+ * origin that runs out of time before answering gets the client a 504.
+ * From the first response byte on, the relay only has to make progress,
+ * reading or writing, every read_timeout.
+ *
+ * Requests are timed into the same histograms as the worker engine's,
+ * and the statistics are served at STATS_PATH.
+ */
+/* $begin event.c */
+#include "event.h"
+#include "cache.h"
+#include "proxy.h"
+#include "dns.h"
+#include "log.h"
+#include "connect.h"
+#include "stats.h"
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+#define ST_REQUEST 0
+#define ST_RESOLVE 1
+#define ST_CONNECT 2
+#define ST_FORWARD 3
+#define ST_RELAY 4
+#define ST_HIT 5
+#define ST_ERROR 6
+#define ST_CLOSED 7
+
+/* one end of a connection as registered with epoll */
+typedef struct Handle {
+    struct Conn *conn;  /* NULL for the listening descriptor and the eventfd */
+    int fd;
+    int events;         /* registered events, -1 if not registered */
+} Handle_t;
+
+typedef struct Conn {
+    int state;
+    Reactor_t *reactor;
+    Handle_t client;
+    Handle_t server;
+    long deadline;       /* when the current state times out, milliseconds */
+    int timer;           /* index in the reactor's timer heap, -1 if not in it */
+    long fetch_end;      /* deadline of the origin's first response byte */
+    long connect_end;    /* deadline of the connect */
+    Dns_job_t *job;      /* lookup in flight, the connection outlives it */
+    int orphaned;        /* closed while the lookup was in flight */
+    Dns_addr_t addrs[DNS_MAX_ADDRS];  /* origin addresses, addr is the next to try */
+    int naddrs;
+    int addr;
+    char head[MAXBUF];   /* request head from the client */
+    size_t head_len;
+    char uri[MAXLINE];
+    Buf_t out;           /* request for the origin, or an error response */
+    size_t out_off;
+    Node_t *node;        /* pinned cache hit being sent */
+    size_t node_off;
+    char buf[MAXBUF];    /* origin bytes not written to the client yet */
+    size_t buf_len;
+    size_t buf_off;
+    char *fill;          /* copy of the response for the cache, NULL once too large */
+    size_t fill_len;
+    size_t relayed;      /* response bytes read from the origin */
+    int source;          /* STATS_HIT or STATS_MISS */
+    long accepted;       /* microseconds, as the stats time them */
+    long start;          /* the request head was in, 0 for no request to time */
+    long first_byte;     /* the client got the first response byte, 0 before */
+    long connecting;     /* the connect to the current address started */
+    long forwarded;      /* the request was sent to the origin */
+    size_t sent;         /* response bytes written to the client */
+    struct Conn *next;   /* closed list link */
+} Conn_t;
+
+/* makes a descriptor non-blocking */
+void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* sets the events a handle waits for */
+static void watch(Reactor_t *reactor, Handle_t *handle, int events) {
+    struct epoll_event ev;
+
+    if (handle->events == events) {
+        return;
+    }
+    ev.events = events;
+    ev.data.ptr = handle;
+    epoll_ctl(reactor->epfd, handle->events < 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+              handle->fd, &ev);
+    handle->events = events;
+}
+
+/* registers a descriptor that belongs to no connection */
+static Handle_t *watch_fd(Reactor_t *reactor, int fd) {
+    Handle_t *handle = (Handle_t *)Malloc(sizeof(Handle_t));
+
+    handle->conn = NULL;
+    handle->fd = fd;
+    handle->events = -1;
+    watch(reactor, handle, EPOLLIN);
+    return handle;
+}
+
+/* creates a reactor for a listening descriptor */
+Reactor_t *create_reactor(int listenfd) {
+    Reactor_t *reactor = (Reactor_t *)Calloc(1, sizeof(Reactor_t));
+
+    if ((reactor->epfd = epoll_create1(0)) < 0) {
+        unix_error("epoll_create1 error");
+    }
+    if ((reactor->wakefd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        unix_error("eventfd error");
+    }
+    reactor->listenfd = listenfd;
+    reactor->reserve_fd = open("/dev/null", O_RDONLY);
+    reactor->cpu = -1;
+    pthread_mutex_init(&reactor->resolved_mutex, NULL);
+    set_nonblocking(listenfd);
+
+    reactor->listen = watch_fd(reactor, listenfd);
+    watch_fd(reactor, reactor->wakefd);
+    return reactor;
+}
+
+/* moves the heap entry at i up or down to where its deadline belongs */
+static void timer_fix(Reactor_t *reactor, int i) {
+    Conn_t **heap = reactor->timers, *conn = heap[i];
+    int child;
+
+    while (i > 0 && heap[(i - 1) / 2]->deadline > conn->deadline) {
+        heap[i] = heap[(i - 1) / 2];
+        heap[i]->timer = i;
+        i = (i - 1) / 2;
+    }
+    while ((child = 2 * i + 1) < reactor->ntimers) {
+        if (child + 1 < reactor->ntimers &&
+            heap[child + 1]->deadline < heap[child]->deadline) {
+            child++;
+        }
+        if (heap[child]->deadline >= conn->deadline) {
+            break;
+        }
+        heap[i] = heap[child];
+        heap[i]->timer = i;
+        i = child;
+    }
+    heap[i] = conn;
+    conn->timer = i;
+}
+
+/* arms the connection's timer for deadline (milliseconds), 0 disarms it */
+static void set_timer(Reactor_t *reactor, Conn_t *conn, long deadline) {
+    int i = conn->timer;
+
+    conn->deadline = deadline;
+    if (deadline == 0) {
+        if (i >= 0) {
+            conn->timer = -1;
+            if (i < --reactor->ntimers) {
+                reactor->timers[i] = reactor->timers[reactor->ntimers];
+                timer_fix(reactor, i);
+            }
+        }
+        return;
+    }
+    if (i < 0) {
+        if (reactor->ntimers == reactor->timers_size) {
+            reactor->timers_size = reactor->timers_size ? 2 * reactor->timers_size : 64;
+            reactor->timers = (Conn_t **)Realloc(reactor->timers,
+                    reactor->timers_size * sizeof(Conn_t *));
+        }
+        i = reactor->ntimers++;
+        reactor->timers[i] = conn;
+    }
+    timer_fix(reactor, i);
+}
+
+/* returns a buffer for a response copy, a spare one if there is */
+static char *get_fill(Reactor_t *reactor) {
+    if (reactor->nfills > 0) {
+        return reactor->fills[--reactor->nfills];
+    }
+    return (char *)Malloc(MAX_OBJECT_SIZE);
+}
+
+/* keeps a response copy buffer for the next miss, or frees it */
+static void put_fill(Reactor_t *reactor, char *fill) {
+    if (fill == NULL) {
+        return;
+    }
+    if (reactor->nfills < FILL_POOL) {
+        reactor->fills[reactor->nfills++] = fill;
+    } else {
+        Free(fill);
+    }
+}
+
+/* closes the origin side of a connection */
+static void close_server(Conn_t *conn) {
+    if (conn->server.fd >= 0) {
+        close(conn->server.fd);
+        conn->server.fd = -1;
+        conn->server.events = -1;
+    }
+}
+
+/*
+ * closes both ends of a connection, the memory is freed after the current
+ * batch of events since a later event may still point at it
+ */
+static void close_conn(Reactor_t *reactor, Conn_t *conn) {
+    __atomic_fetch_sub(&stats.active_connections, 1, __ATOMIC_RELAXED);
+    if (conn->start != 0) {
+        stats_request(conn->source, conn->accepted, conn->start, conn->first_byte,
+                      conn->sent);
+    }
+    close(conn->client.fd);
+    close_server(conn);
+    if (conn->node) {
+        release_node(conn->node);
+    }
+    buf_free(&conn->out);
+    put_fill(reactor, conn->fill);
+    conn->fill = NULL;
+    set_timer(reactor, conn, 0);
+    conn->state = ST_CLOSED;
+    conn->next = reactor->closed;
+    reactor->closed = conn;
+
+    if (reactor->paused) {
+        /* a descriptor is free again */
+        reactor->paused = 0;
+        watch(reactor, reactor->listen, EPOLLIN);
+    }
+}
+
+/* sends the response in out and closes the connection once it is sent */
+static void send_out(Reactor_t *reactor, Conn_t *conn) {
+    conn->out_off = 0;
+    conn->state = ST_ERROR;
+    set_timer(reactor, conn, now_ms() + request_timeout);
+    watch(reactor, &conn->client, EPOLLOUT);
+}
+
+/* queues an error response and closes the connection once it is sent */
+static void send_error(Reactor_t *reactor, Conn_t *conn, char *cause,
+        char *errnum, char *shortmsg, char *longmsg) {
+    close_server(conn);
+    buf_free(&conn->out);
+    buf_init(&conn->out);
+    format_error(&conn->out, cause, errnum, shortmsg, longmsg);
+    send_out(reactor, conn);
+}
+
+/*
+ * starts a non-blocking connect to the next origin address, giving it an
+ * equal share of the connect time left; answers 502, or 504 once the time
+ * is up, when no address is left
+ */
+static void connect_next(Reactor_t *reactor, Conn_t *conn) {
+    Dns_addr_t *addr;
+    long now = now_ms();
+    int fd;
+
+    close_server(conn);
+    while (conn->addr < conn->naddrs && now < conn->connect_end) {
+        addr = &conn->addrs[conn->addr++];
+        if ((fd = socket(addr->family, addr->socktype | SOCK_NONBLOCK,
+                         addr->protocol)) < 0) {
+            continue;
+        }
+        conn->connecting = now_us();
+        if (connect(fd, (SA *)&addr->addr, addr->addrlen) == 0 || errno == EINPROGRESS) {
+            conn->server.fd = fd;
+            conn->state = ST_CONNECT;
+            set_timer(reactor, conn, now + (conn->connect_end - now) /
+                      (conn->naddrs - conn->addr + 1));
+            watch(reactor, &conn->client, 0);
+            watch(reactor, &conn->server, EPOLLOUT);
+            return;
+        }
+        close(fd);
+    }
+    if (now >= conn->connect_end) {
+        send_error(reactor, conn, "", "504", "Gateway Timeout",
+                   "Web Proxy timed out connecting to the server");
+    } else {
+        send_error(reactor, conn, "", "502", "Bad Gateway",
+                   "Web Proxy could not connect to the server");
+    }
+}
+
+/* starts connecting once the lookup of the origin is answered */
+static void on_lookup(Reactor_t *reactor, Conn_t *conn, Dns_job_t *job) {
+    if (job->naddrs < 0) {
+        send_error(reactor, conn, job->host, "502", "Bad Gateway",
+                   "Web Proxy could not resolve the server");
+        return;
+    }
+    memcpy(conn->addrs, job->addrs, job->naddrs * sizeof(Dns_addr_t));
+    conn->naddrs = job->naddrs;
+    conn->addr = 0;
+    interleave_addrs(conn->addrs, conn->naddrs);
+    connect_next(reactor, conn);
+}
+
+/* hands a finished lookup back to its reactor, called on a resolver thread */
+static void lookup_done(Dns_job_t *job) {
+    Reactor_t *reactor = ((Conn_t *)job->arg)->reactor;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&reactor->resolved_mutex);
+    job->next = reactor->resolved;
+    reactor->resolved = job;
+    pthread_mutex_unlock(&reactor->resolved_mutex);
+    write(reactor->wakefd, &one, sizeof(one));
+}
+
+/* takes the lookups the resolver threads finished */
+static void on_wake(Reactor_t *reactor) {
+    Dns_job_t *job, *next;
+    Conn_t *conn;
+    uint64_t count;
+
+    read(reactor->wakefd, &count, sizeof(count));
+    pthread_mutex_lock(&reactor->resolved_mutex);
+    job = reactor->resolved;
+    reactor->resolved = NULL;
+    pthread_mutex_unlock(&reactor->resolved_mutex);
+
+    for (; job != NULL; job = next) {
+        next = job->next;
+        conn = (Conn_t *)job->arg;
+        conn->job = NULL;
+        if (conn->state == ST_RESOLVE) {
+            on_lookup(reactor, conn, job);
+        } else if (conn->orphaned) {
+            /* closed in an earlier batch and left for the lookup to free */
+            Free(conn);
+        }
+        Free(job);
+    }
+}
+
+/* acts on a complete request head: cache hit, error or origin connect */
+static void start_request(Reactor_t *reactor, Conn_t *conn, Http_request_t *req,
+        int rc) {
+    char method[MAXLINE], host[MAXLINE], port[MAXLINE], query[MAXLINE];
+    Dns_job_t *job;
+    long now;
+
+    if (rc < 0 || http_copy(method, MAXLINE, &req->method) < 0 ||
+        http_copy(conn->uri, MAXLINE, &req->target) < 0) {
+        send_error(reactor, conn, "", "400", "Bad Request",
+                   "Web Proxy could not parse the request");
+        return;
+    }
+    if (strcasecmp(method, "GET")) {
+        /* Not a GET request */
+        send_error(reactor, conn, method, "501", "Not Implemented",
+                   "Web Proxy does not implement this method");
+        return;
+    }
+    if (!strcmp(conn->uri, STATS_PATH)) {
+        if (!stats_local(conn->client.fd)) {
+            send_error(reactor, conn, STATS_PATH, "403", "Forbidden",
+                       "Web Proxy serves its statistics to local clients only");
+            return;
+        }
+        buf_init(&conn->out);
+        stats_response(&conn->out, 0);
+        send_out(reactor, conn);
+        return;
+    }
+    conn->start = now_us();
+    stats_add(&stats.client_bytes_in, conn->head_len);
+
+    if ((conn->node = get_cache(conn->uri)) != NULL) {
+        /* uri in cache, send it straight from the pinned node */
+        conn->source = STATS_HIT;
+        conn->state = ST_HIT;
+        set_timer(reactor, conn, now_ms() + request_timeout);
+        watch(reactor, &conn->client, EPOLLOUT);
+        return;
+    }
+
+    /* uri not in cache */
+    conn->source = STATS_MISS;
+    parse_uri(conn->uri, host, port, query);
+    buf_init(&conn->out);
+    build_request(&conn->out, req, query, host, 0);
+    conn->out_off = 0;
+
+    now = now_ms();
+    conn->fetch_end = now + request_timeout;
+    conn->connect_end = (now + connect_timeout < conn->fetch_end) ?
+                        now + connect_timeout : conn->fetch_end;
+
+    /* the lookup may block, so unless the cache has it a resolver thread does it */
+    job = (Dns_job_t *)Malloc(sizeof(Dns_job_t));
+    strcpy(job->host, host);
+    strcpy(job->port, port);
+    job->done = lookup_done;
+    job->arg = conn;
+    if (dns_resolve_async(job)) {
+        on_lookup(reactor, conn, job);
+        Free(job);
+        return;
+    }
+    conn->job = job;
+    conn->state = ST_RESOLVE;
+    set_timer(reactor, conn, conn->connect_end);
+    watch(reactor, &conn->client, 0);
+}
+
+/* reads the request head, returns 0 if the connection was closed */
+static int read_head(Reactor_t *reactor, Conn_t *conn) {
+    Http_request_t req;
+    ssize_t n;
+    int rc;
+
+    while (conn->head_len < sizeof(conn->head) - 1) {
+        n = read(conn->client.fd, conn->head + conn->head_len,
+                 sizeof(conn->head) - 1 - conn->head_len);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return 1;
+        }
+        if (n <= 0) {
+            close_conn(reactor, conn);
+            return 0;
+        }
+        conn->head_len += n;
+        conn->head[conn->head_len] = '\0';
+        if ((rc = http_parse_request(conn->head, conn->head_len, &req)) !=
+            HTTP_INCOMPLETE) {
+            start_request(reactor, conn, &req, rc);
+            return 1;
+        }
+    }
+    send_error(reactor, conn, "", "431", "Request Header Fields Too Large",
+               "Web Proxy could not read the request");
+    return 1;
+}
+
+/*
+ * writes from buf to fd until done or the socket is full, returns 1 when
+ * everything was written, 0 if it has to wait and -1 on error
+ */
+static int write_some(int fd, char *buf, size_t len, size_t *off) {
+    ssize_t n;
+
+    while (*off < len) {
+        if ((n = write(fd, buf + *off, len - *off)) < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return 0;
+            }
+            return -1;
+        }
+        *off += n;
+    }
+    return 1;
+}
+
+/* write_some to the client, counting the bytes for the stats */
+static int write_client(Conn_t *conn, char *buf, size_t len, size_t *off) {
+    size_t before = *off;
+    int rc = write_some(conn->client.fd, buf, len, off);
+
+    if (*off > before) {
+        if (conn->sent == 0) {
+            conn->first_byte = now_us();
+        }
+        conn->sent += *off - before;
+    }
+    return rc;
+}
+
+/* the origin closed: cache the response if it fits and close up */
+static void finish_relay(Reactor_t *reactor, Conn_t *conn) {
+    Node_t *node;
+
+    if (conn->fill != NULL && conn->fill_len < MAX_OBJECT_SIZE) {
+        node = put_cache(conn->uri, conn->fill, conn->fill_len);
+        if (node) {
+            access_node(node);
+            release_node(node);
+        }
+    }
+    close_conn(reactor, conn);
+}
+
+/* copies one chunk from the origin toward the client */
+static void relay_server(Reactor_t *reactor, Conn_t *conn) {
+    ssize_t n = read(conn->server.fd, conn->buf, sizeof(conn->buf));
+    int rc;
+
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (n < 0) {
+        close_conn(reactor, conn);
+        return;
+    }
+    if (n == 0) {
+        finish_relay(reactor, conn);
+        return;
+    }
+
+    if (conn->fill != NULL) {
+        if (conn->fill_len + n < MAX_OBJECT_SIZE) {
+            memcpy(conn->fill + conn->fill_len, conn->buf, n);
+            conn->fill_len += n;
+        } else {
+            /* too large for the cache */
+            put_fill(reactor, conn->fill);
+            conn->fill = NULL;
+        }
+    }
+    if (conn->relayed == 0) {
+        stats_observe(&stats.upstream_ttfb, now_us() - conn->forwarded);
+    }
+    conn->relayed += n;
+    set_timer(reactor, conn, now_ms() + read_timeout);
+    stats_add(&stats.origin_bytes_in, n);
+
+    conn->buf_len = n;
+    conn->buf_off = 0;
+    if ((rc = write_client(conn, conn->buf, conn->buf_len, &conn->buf_off)) < 0) {
+        close_conn(reactor, conn);
+    } else if (rc == 0) {
+        /* the client is behind, wait for it before reading more */
+        watch(reactor, &conn->server, 0);
+        watch(reactor, &conn->client, EPOLLOUT);
+    }
+}
+
+/* handles readiness of the client side of a connection */
+static void on_client(Reactor_t *reactor, Conn_t *conn, int events) {
+    int rc;
+
+    switch (conn->state) {
+    case ST_REQUEST:
+        read_head(reactor, conn);
+        return;
+    case ST_HIT:
+        rc = write_client(conn, conn->node->response, conn->node->size, &conn->node_off);
+        if (rc > 0) {
+            access_node(conn->node);
+        }
+        if (rc != 0) {
+            close_conn(reactor, conn);
+        }
+        return;
+    case ST_ERROR:
+        if (write_client(conn, conn->out.data, conn->out.len, &conn->out_off) != 0) {
+            close_conn(reactor, conn);
+        }
+        return;
+    case ST_RELAY:
+        rc = write_client(conn, conn->buf, conn->buf_len, &conn->buf_off);
+        set_timer(reactor, conn, now_ms() + read_timeout);
+        if (rc < 0) {
+            close_conn(reactor, conn);
+        } else if (rc > 0) {
+            watch(reactor, &conn->client, 0);
+            watch(reactor, &conn->server, EPOLLIN);
+        }
+        return;
+    default:
+        /* waiting on the origin, the client hung up */
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            close_conn(reactor, conn);
+        }
+        return;
+    }
+}
+
+/* handles readiness of the origin side of a connection */
+static void on_server(Reactor_t *reactor, Conn_t *conn, int events) {
+    int err = 0, rc;
+    socklen_t len = sizeof(err);
+
+    switch (conn->state) {
+    case ST_CONNECT:
+        getsockopt(conn->server.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            /* refused or unreachable, on to the next address */
+            connect_next(reactor, conn);
+            return;
+        }
+        stats_observe(&stats.upstream_connect, now_us() - conn->connecting);
+        conn->state = ST_FORWARD;
+        set_timer(reactor, conn, conn->fetch_end);
+        /* fall through */
+    case ST_FORWARD:
+        rc = write_some(conn->server.fd, conn->out.data, conn->out.len, &conn->out_off);
+        if (rc < 0) {
+            send_error(reactor, conn, "", "502", "Bad Gateway",
+                       "Web Proxy could not send the request");
+        } else if (rc > 0) {
+            conn->forwarded = now_us();
+            stats_add(&stats.origin_bytes_out, conn->out.len);
+            conn->state = ST_RELAY;
+            conn->fill = get_fill(reactor);
+            conn->fill_len = 0;
+            watch(reactor, &conn->server, EPOLLIN);
+        }
+        return;
+    case ST_RELAY:
+        relay_server(reactor, conn);
+        return;
+    }
+}
+
+/* handles a deadline that passed */
+static void on_timeout(Reactor_t *reactor, Conn_t *conn) {
+    switch (conn->state) {
+    case ST_RESOLVE:
+        send_error(reactor, conn, conn->job->host, "504", "Gateway Timeout",
+                   "Web Proxy timed out resolving the server");
+        return;
+    case ST_CONNECT:
+        /* this address had its share, on to the next */
+        connect_next(reactor, conn);
+        return;
+    case ST_FORWARD:
+    case ST_RELAY:
+        if (conn->relayed == 0) {
+            send_error(reactor, conn, "", "504", "Gateway Timeout",
+                       "Web Proxy timed out waiting for the server");
+            return;
+        }
+        close_conn(reactor, conn);
+        return;
+    default:
+        /* a client too slow to send its request or take the response */
+        close_conn(reactor, conn);
+        return;
+    }
+}
+
+/*
+ * gives up the reserve descriptor to accept and close one connection, so
+ * that a listener readable at EMFILE does not spin the reactor; without a
+ * reserve the listener is unwatched until a connection closes
+ */
+static void shed_connection(Reactor_t *reactor) {
+    int fd;
+
+    log_msg(LOG_WARN, "accept error: %s, dropping a connection", strerror(errno));
+    if (reactor->reserve_fd >= 0) {
+        close(reactor->reserve_fd);
+        if ((fd = accept(reactor->listenfd, NULL, NULL)) >= 0) {
+            close(fd);
+        }
+        reactor->reserve_fd = open("/dev/null", O_RDONLY);
+        if (fd >= 0) {
+            return;
+        }
+    }
+    reactor->paused = 1;
+    watch(reactor, reactor->listen, 0);
+}
+
+/* accepts every pending connection */
+static void on_accept(Reactor_t *reactor) {
+    Conn_t *conn;
+    long idle = 1000L * (client_idle_timeout > 0 ? client_idle_timeout : CLIENT_IDLE_TIMEOUT);
+    int fd;
+
+    while (!reactor->paused) {
+        if ((fd = accept(reactor->listenfd, NULL, NULL)) < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                shed_connection(reactor);
+                continue;
+            }
+            if (errno == ECONNABORTED || errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        set_nonblocking(fd);
+        conn = (Conn_t *)Malloc(sizeof(Conn_t));
+        conn->state = ST_REQUEST;
+        conn->reactor = reactor;
+        conn->timer = -1;
+        conn->job = NULL;
+        conn->orphaned = 0;
+        conn->relayed = 0;
+        conn->accepted = now_us();
+        conn->start = 0;
+        conn->first_byte = 0;
+        conn->sent = 0;
+        __atomic_fetch_add(&stats.active_connections, 1, __ATOMIC_RELAXED);
+        conn->client.conn = conn;
+        conn->client.fd = fd;
+        conn->client.events = -1;
+        conn->server.conn = conn;
+        conn->server.fd = -1;
+        conn->server.events = -1;
+        conn->head_len = 0;
+        conn->out.data = NULL;
+        conn->out.len = conn->out.size = 0;
+        conn->node = NULL;
+        conn->node_off = 0;
+        conn->fill = NULL;
+        conn->buf_len = 0;
+        conn->buf_off = 0;
+        set_timer(reactor, conn, now_ms() + idle);
+        watch(reactor, &conn->client, EPOLLIN);
+    }
+}
+
+/* serves the reactor's connections forever */
+void run_reactor(Reactor_t *reactor) {
+    struct epoll_event events[EVENT_MAX];
+    int n, i, timeout;
+    long now;
+
+    while (1) {
+        timeout = -1;
+        if (reactor->ntimers > 0) {
+            now = now_ms();
+            timeout = (reactor->timers[0]->deadline > now) ?
+                      reactor->timers[0]->deadline - now : 0;
+        }
+        if (cache_lockfree) {
+            /* buffered hits must not keep their nodes pinned while the reactor waits */
+            drain_access();
+        }
+        if ((n = epoll_wait(reactor->epfd, events, EVENT_MAX, timeout)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            unix_error("epoll_wait error");
+        }
+        for (i = 0; i < n; i++) {
+            Handle_t *handle = (Handle_t *)events[i].data.ptr;
+            Conn_t *conn = handle->conn;
+
+            if (handle == reactor->listen) {
+                on_accept(reactor);
+            } else if (conn == NULL) {
+                on_wake(reactor);
+            } else if (conn->state == ST_CLOSED) {
+                continue;
+            } else if (handle == &conn->client) {
+                on_client(reactor, conn, events[i].events);
+            } else {
+                on_server(reactor, conn, events[i].events);
+            }
+        }
+
+        now = now_ms();
+        while (reactor->ntimers > 0 && reactor->timers[0]->deadline <= now) {
+            Conn_t *conn = reactor->timers[0];
+            set_timer(reactor, conn, 0);
+            on_timeout(reactor, conn);
+        }
+
+        while (reactor->closed) {
+            Conn_t *conn = reactor->closed;
+            reactor->closed = conn->next;
+            if (conn->job != NULL) {
+                /* a resolver thread still holds it, on_wake frees it */
+                conn->orphaned = 1;
+            } else {
+                Free(conn);
+            }
+        }
+    }
+}
+
+/* pins the calling thread to the index-th cpu it is allowed to run on */
+static void pin_cpu(int index) {
+    unsigned long mask[CPU_MASK_WORDS], pin[CPU_MASK_WORDS];
+    int bits = 8 * sizeof(unsigned long), allowed = 0, cpu;
+
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(mask), mask) < 0) {
+        return;
+    }
+    for (cpu = 0; cpu < CPU_MASK_WORDS * bits; cpu++) {
+        allowed += (mask[cpu / bits] >> (cpu % bits)) & 1;
+    }
+    index %= allowed;
+    for (cpu = 0; ; cpu++) {
+        if (((mask[cpu / bits] >> (cpu % bits)) & 1) && index-- == 0) {
+            break;
+        }
+    }
+    memset(pin, 0, sizeof(pin));
+    pin[cpu / bits] = 1UL << (cpu % bits);
+    if (syscall(SYS_sched_setaffinity, 0, sizeof(pin), pin) < 0) {
+        log_msg(LOG_WARN, "could not pin reactor to cpu %d: %s", cpu, strerror(errno));
+    }
+}
+
+/* runs one reactor, pinned to a cpu if the reactor asks for it */
+static void *reactor_thread(void *arg) {
+    Reactor_t *reactor = (Reactor_t *)arg;
+
+    if (reactor->cpu >= 0) {
+        pin_cpu(reactor->cpu);
+    }
+    run_reactor(reactor);
+    return NULL;
+}
+
+/*
+ * starts n reactors, one per cpu if n is 0, each with its own SO_REUSEPORT
+ * listening socket on port, and serves with them forever
+ */
+void run_reactors(char *port, int n, int pin) {
+    Reactor_t **reactors;
+    pthread_t tid;
+    int i;
+
+    if (n <= 0 && (n = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+        n = 1;
+    }
+    reactors = (Reactor_t **)Malloc(n * sizeof(Reactor_t *));
+    for (i = 0; i < n; i++) {
+        reactors[i] = create_reactor(Open_listenfd_opt(port, 1));
+        reactors[i]->cpu = pin ? i : -1;
+    }
+    for (i = 1; i < n; i++) {
+        Pthread_create(&tid, NULL, reactor_thread, reactors[i]);
+        Pthread_detach(tid);
+    }
+    reactor_thread(reactors[0]);
+}
+
+/* $end event.c */
@@ -0,0 +1,54 @@
+/*
+ * event.h - epoll based event-driven connection engine for the web proxy,
+ * definition and prototypes.
+ */
+/* $begin event.h */
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include "csapp.h"
+#include "dns.h"
+#include <sys/epoll.h>
+
+#define EVENT_MAX 256      /* events handled per epoll_wait */
+#define CPU_MASK_WORDS 16  /* affinity mask words, 1024 cpus */
+#define FILL_POOL 8        /* spare response copy buffers a reactor keeps */
+
+/* one epoll instance serving the connections accepted on listenfd */
+typedef struct Reactor {
+    int epfd;
+    int listenfd;
+    struct Handle *listen;  /* registration of listenfd */
+    int reserve_fd;         /* spare descriptor, given up to shed a connection at EMFILE */
+    int paused;             /* listenfd unwatched until a connection closes */
+    int wakefd;             /* eventfd the resolver threads signal */
+    int cpu;                /* cpu to pin the reactor's thread to, -1 for none */
+    struct Conn *closed;    /* connections to free after the current batch */
+    struct Conn **timers;   /* min-heap of connections by deadline */
+    int ntimers;
+    int timers_size;
+    Dns_job_t *resolved;    /* finished lookups, under resolved_mutex */
+    pthread_mutex_t resolved_mutex;
+    char *fills[FILL_POOL]; /* spare buffers for response copies */
+    int nfills;
+} Reactor_t;
+
+/* function prototypes */
+
+/* makes a descriptor non-blocking */
+void set_nonblocking(int fd);
+
+/* creates a reactor for a listening descriptor */
+Reactor_t *create_reactor(int listenfd);
+
+/* serves the reactor's connections forever */
+void run_reactor(Reactor_t *reactor);
+
+/*
+ * starts n reactors, one per cpu if n is 0, each with its own SO_REUSEPORT
+ * listening socket on port, and serves with them forever
+ */
+void run_reactors(char *port, int n, int pin);
+
+#endif /* __EVENT_H__ */
+/* $end event.h */
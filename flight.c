@@ -0,0 +1,239 @@
+/*
+ * flight.c - coalescing of concurrent misses on the same uri.
+ *
+ * Flights are found through a small hash table under one mutex; the bytes
+ * of each flight are guarded by the flight's own mutex. A flight leaves
+ * the table when it finishes (the response is then in the cache) or once
+ * it grows past MAX_OBJECT_SIZE, after which it only keeps buffering for
+ * the followers already attached. From then on the bytes all of them have
+ * read are dropped, and the leader holds back while FLIGHT_WINDOW bytes
+ * are waiting for the slowest; a follower that stalls for FLIGHT_LAG
+ * seconds is cut off rather than the whole flight with it.
+ */
+/* $begin flight.c */
+#include "flight.h"
+#include "cache.h"
+
+static Flight_t *flight_table[FLIGHT_BUCKETS];
+static pthread_mutex_t table_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* initializes the table of flights */
+void init_flight() {
+    memset(flight_table, 0, sizeof(flight_table));
+}
+
+/* removes a flight from the table, table_mutex must be held */
+static void unlink_flight(Flight_t *flight) {
+    Flight_t **pos = &flight_table[flight->hash & (FLIGHT_BUCKETS - 1)];
+    while (*pos != NULL) {
+        if (*pos == flight) {
+            *pos = flight->hnext;
+            break;
+        }
+        pos = &(*pos)->hnext;
+    }
+    flight->joinable = 0;
+}
+
+/* unlinks reader from the followers, flight->mutex must be held */
+static void unlink_reader(Flight_t *flight, Flight_reader_t *reader) {
+    Flight_reader_t **pos = &flight->readers;
+    while (*pos != NULL) {
+        if (*pos == reader) {
+            *pos = reader->next;
+            break;
+        }
+        pos = &(*pos)->next;
+    }
+}
+
+/*
+ * attaches to the flight for uri, creating it if there is none; *leader
+ * is set to 1 if the caller must fetch the response, else the caller
+ * follows it through reader
+ */
+Flight_t *flight_join(char *uri, Flight_reader_t *reader, int *leader) {
+    unsigned int hash = hash_uri(uri);
+    Flight_t *flight;
+
+    pthread_mutex_lock(&table_mutex);
+    for (flight = flight_table[hash & (FLIGHT_BUCKETS - 1)]; flight != NULL;
+         flight = flight->hnext) {
+        if (flight->hash == hash && !strcasecmp(flight->uri, uri)) {
+            pthread_mutex_lock(&flight->mutex);
+            flight->refcount++;
+            reader->off = 0;
+            reader->dropped = 0;
+            reader->next = flight->readers;
+            flight->readers = reader;
+            pthread_mutex_unlock(&flight->mutex);
+            pthread_mutex_unlock(&table_mutex);
+            *leader = 0;
+            return flight;
+        }
+    }
+
+    flight = (Flight_t *)Calloc(1, sizeof(Flight_t));
+    flight->uri = strdup(uri);
+    flight->hash = hash;
+    flight->joinable = 1;
+    flight->buffering = 1;
+    flight->refcount = 1;
+    pthread_mutex_init(&flight->mutex, NULL);
+    pthread_cond_init(&flight->cond, NULL);
+    flight->hnext = flight_table[hash & (FLIGHT_BUCKETS - 1)];
+    flight_table[hash & (FLIGHT_BUCKETS - 1)] = flight;
+    pthread_mutex_unlock(&table_mutex);
+
+    *leader = 1;
+    return flight;
+}
+
+/*
+ * drops the bytes every follower has read and waits until n more fit in
+ * FLIGHT_WINDOW, cutting off the slowest followers if none of them reads
+ * for FLIGHT_LAG seconds; flight->mutex must be held
+ */
+static void make_room(Flight_t *flight, size_t n) {
+    Flight_reader_t **pos, *reader;
+    struct timespec until;
+    size_t low;
+
+    while (flight->readers != NULL) {
+        for (low = flight->len, reader = flight->readers; reader != NULL;
+             reader = reader->next) {
+            low = (reader->off < low) ? reader->off : low;
+        }
+        if (low > flight->base) {
+            memmove(flight->data, flight->data + (low - flight->base),
+                    flight->len - low);
+            flight->base = low;
+        }
+        if (flight->len - flight->base + n <= FLIGHT_WINDOW ||
+            flight->len == flight->base) {
+            return;
+        }
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += FLIGHT_LAG;
+        flight->waiting = 1;
+        if (pthread_cond_timedwait(&flight->cond, &flight->mutex, &until) == ETIMEDOUT) {
+            for (pos = &flight->readers; *pos != NULL;) {
+                if ((*pos)->off == low) {
+                    (*pos)->dropped = 1;
+                    *pos = (*pos)->next;
+                } else {
+                    pos = &(*pos)->next;
+                }
+            }
+            pthread_cond_broadcast(&flight->cond);
+        }
+        flight->waiting = 0;
+    }
+}
+
+/*
+ * appends bytes received by the leader and wakes the followers, returns
+ * 0 once the flight has stopped buffering for good
+ */
+int flight_append(Flight_t *flight, char *buf, size_t n) {
+    int buffering;
+
+    if (flight->joinable && flight->len + n > MAX_OBJECT_SIZE) {
+        /* too large for the cache, no new followers from now on */
+        pthread_mutex_lock(&table_mutex);
+        unlink_flight(flight);
+        pthread_mutex_unlock(&table_mutex);
+    }
+
+    pthread_mutex_lock(&flight->mutex);
+    if (!flight->joinable && flight->buffering) {
+        make_room(flight, n);
+    }
+    if (!flight->joinable && flight->readers == NULL) {
+        /* nobody else will ever read the data */
+        flight->buffering = 0;
+    }
+    if (flight->buffering) {
+        if (flight->len - flight->base + n > flight->cap) {
+            flight->cap = (flight->cap == 0) ? MAXBUF : flight->cap;
+            while (flight->len - flight->base + n > flight->cap) {
+                flight->cap *= 2;
+            }
+            flight->data = (char *)Realloc(flight->data, flight->cap);
+        }
+        memcpy(flight->data + (flight->len - flight->base), buf, n);
+        flight->len += n;
+        pthread_cond_broadcast(&flight->cond);
+    }
+    buffering = flight->buffering;
+    pthread_mutex_unlock(&flight->mutex);
+    return buffering;
+}
+
+/* marks the flight complete (ok = 1) or failed (ok = 0) */
+void flight_finish(Flight_t *flight, int ok) {
+    pthread_mutex_lock(&table_mutex);
+    if (flight->joinable) {
+        unlink_flight(flight);
+    }
+    pthread_mutex_unlock(&table_mutex);
+
+    pthread_mutex_lock(&flight->mutex);
+    flight->done = ok ? 1 : -1;
+    pthread_cond_broadcast(&flight->cond);
+    pthread_mutex_unlock(&flight->mutex);
+}
+
+/*
+ * copies up to n bytes from the offset of reader into buf, waiting for
+ * them to arrive; returns 0 at the end of a complete response, -1 if it
+ * failed or the reader was cut off
+ */
+ssize_t flight_read(Flight_t *flight, Flight_reader_t *reader, char *buf, size_t n) {
+    size_t off = reader->off;
+    ssize_t rc;
+
+    pthread_mutex_lock(&flight->mutex);
+    while (flight->len <= off && !flight->done && !reader->dropped) {
+        pthread_cond_wait(&flight->cond, &flight->mutex);
+    }
+    if (reader->dropped) {
+        rc = -1;
+    } else if (flight->len > off) {
+        rc = (flight->len - off < n) ? flight->len - off : n;
+        memcpy(buf, flight->data + (off - flight->base), rc);
+        reader->off += rc;
+        if (flight->waiting) {
+            pthread_cond_broadcast(&flight->cond);
+        }
+    } else {
+        rc = (flight->done > 0) ? 0 : -1;
+    }
+    pthread_mutex_unlock(&flight->mutex);
+    return rc;
+}
+
+/* detaches the leader (reader NULL) or a follower, freeing it after the last one */
+void flight_release(Flight_t *flight, Flight_reader_t *reader) {
+    int refcount;
+
+    pthread_mutex_lock(&flight->mutex);
+    if (reader != NULL) {
+        unlink_reader(flight, reader);
+        if (flight->waiting) {
+            pthread_cond_broadcast(&flight->cond);
+        }
+    }
+    refcount = --flight->refcount;
+    pthread_mutex_unlock(&flight->mutex);
+
+    if (refcount == 0) {
+        pthread_mutex_destroy(&flight->mutex);
+        pthread_cond_destroy(&flight->cond);
+        Free(flight->data);
+        Free(flight->uri);
+        Free(flight);
+    }
+}
+
+/* $end flight.c */
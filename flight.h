@@ -0,0 +1,79 @@
+/*
+ * flight.h - coalescing of concurrent misses on the same uri,
+ * definition and prototypes.
+ */
+/* $begin flight.h */
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include "csapp.h"
+
+#define FLIGHT_BUCKETS 256
+#define FLIGHT_WINDOW (16 * MAXBUF)  /* bytes kept for followers past MAX_OBJECT_SIZE */
+#define FLIGHT_LAG 10                /* seconds a full window waits for a follower */
+
+/* a follower's place in a flight */
+typedef struct Flight_reader {
+    size_t off;                   /* bytes read so far */
+    int dropped;                  /* 1 if cut off for falling behind */
+    struct Flight_reader *next;
+} Flight_reader_t;
+
+/*
+ * a response being fetched from the origin. The first request for a uri
+ * becomes the leader and appends the bytes as they arrive; later requests
+ * attach as followers and stream the same bytes to their clients. Past
+ * MAX_OBJECT_SIZE only a window of FLIGHT_WINDOW bytes is kept, and the
+ * leader waits for the slowest follower to make room in it.
+ */
+typedef struct Flight {
+    struct Flight *hnext;  /* next flight in the same bucket */
+    char *uri;
+    unsigned int hash;
+    char *data;            /* response received from base on */
+    size_t base;           /* bytes every follower has read and were dropped */
+    size_t len;            /* bytes received, base included */
+    size_t cap;
+    int joinable;          /* 0 once new requests can no longer attach */
+    int buffering;         /* 0 once data stops growing, no follower needs it */
+    int done;              /* 1 when complete, -1 if the fetch failed */
+    int waiting;           /* 1 while the leader waits for room in the window */
+    int refcount;          /* leader plus followers */
+    Flight_reader_t *readers;  /* the followers still reading */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} Flight_t;
+
+/* function prototypes */
+
+/* initializes the table of flights */
+void init_flight();
+
+/*
+ * attaches to the flight for uri, creating it if there is none; *leader
+ * is set to 1 if the caller must fetch the response, else the caller
+ * follows it through reader
+ */
+Flight_t *flight_join(char *uri, Flight_reader_t *reader, int *leader);
+
+/*
+ * appends bytes received by the leader and wakes the followers, returns
+ * 0 once the flight has stopped buffering for good
+ */
+int flight_append(Flight_t *flight, char *buf, size_t n);
+
+/* marks the flight complete (ok = 1) or failed (ok = 0) */
+void flight_finish(Flight_t *flight, int ok);
+
+/*
+ * copies up to n bytes from the offset of reader into buf, waiting for
+ * them to arrive; returns 0 at the end of a complete response, -1 if it
+ * failed or the reader was cut off
+ */
+ssize_t flight_read(Flight_t *flight, Flight_reader_t *reader, char *buf, size_t n);
+
+/* detaches the leader (reader NULL) or a follower, freeing it after the last one */
+void flight_release(Flight_t *flight, Flight_reader_t *reader);
+
+#endif /* __FLIGHT_H__ */
+/* $end flight.h */
@@ -0,0 +1,21 @@
+/*
+ * hash.h - string hash shared by the cache and the address lookups.
+ */
+/* $begin hash.h */
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include "csapp.h"
+
+/* computes the case-insensitive hash of a string (FNV-1a) */
+static inline unsigned int hash_str(char *s) {
+    unsigned int hash = 2166136261u;
+    while (*s) {
+        hash ^= (unsigned char)tolower((unsigned char)*s++);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+#endif /* __HASH_H__ */
+/* $end hash.h */
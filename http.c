@@ -0,0 +1,575 @@
+/*
+ * http.c - single pass HTTP/1.x request and response head parser.
+ *
+ * The head is walked once, left to right, and every part of it comes
+ * back as a slice of the caller's buffer: the request or status line and
+ * a table of header names and values. Nothing is copied or null
+ * terminated. Lines may end in CRLF or a bare LF.
+ *
+ * The time goes into finding where tokens and header values end. On x86
+ * this is done 16 bytes at a time with the SSE4.2 string compare in
+ * range mode, or 32 bytes at a time with AVX2 compares, whichever the
+ * cpu has. Elsewhere, and for the bytes short of a vector, the scalar
+ * scanners test a machine word at a time with borrow tricks, which keeps
+ * them ahead of the memchr and strncasecmp of line by line parsing. The
+ * SIMD scanners are compiled for their instruction set with function
+ * attributes, so the binary runs on any x86-64 and init_http picks one
+ * at startup.
+ *
+ * Chunked bodies are undone here too, as a state machine that takes the
+ * body in whatever pieces it arrives, for clients that predate chunks.
+ */
+/* $begin http.c */
+#include "http.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HTTP_X86
+#include <immintrin.h>
+#endif
+
+int http_simd = HTTP_SCALAR;
+
+#define SCAN_SHORT 16  /* bytes the word scanner takes before a vector one */
+
+/* bytes that may be part of a token or a header value, see token_scalar */
+static unsigned char token_byte[256];
+static unsigned char value_byte[256];
+
+/* fills the byte tables and picks the scanner for this cpu */
+void init_http() {
+    int c;
+
+    for (c = 0; c < 256; c++) {
+        token_byte[c] = (c > ' ' && c != 0x7f);
+        value_byte[c] = ((c >= ' ' || c == '\t') && c != 0x7f);
+    }
+
+    http_simd = HTTP_SCALAR;
+#ifdef HTTP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        http_simd = HTTP_AVX2;
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        http_simd = HTTP_SSE42;
+    }
+#endif
+}
+
+/*
+ * Word at a time tests: ONES has 1 in every byte, so n * ONES repeats n.
+ * word_below(x, n) sets the top bit of each byte of x below n (n <=
+ * 0x80). A borrow may set it in bytes after the first such byte, but
+ * never before, so the lowest bit set marks the first one. word_zero(x)
+ * does that for 0 bytes.
+ */
+#define ONES (~0UL / 255)
+#define word_below(x, n) (((x) - ONES * (n)) & ~(x) & (ONES * 0x80))
+#define word_zero(x) word_below(x, 1)
+
+/* loads the word at p, with the first byte in the low bits */
+static unsigned long word_load(const char *p) {
+    unsigned long x;
+
+    memcpy(&x, p, sizeof(x));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    x = (sizeof(x) == 8) ? __builtin_bswap64(x) : __builtin_bswap32(x);
+#endif
+    return x;
+}
+
+/* returns the first byte marked in a word test of the word at p */
+static const char *word_first(const char *p, unsigned long mask) {
+    return p + __builtin_ctzl(mask) / 8;
+}
+
+/*
+ * A token (method, target, header name) ends at a control byte, space,
+ * DEL or its delimiter. A header value ends at a control byte other
+ * than tab, or DEL. A table lookup finishes the bytes short of a word.
+ */
+static const char *token_scalar(const char *p, const char *end, char delim) {
+    unsigned long x, mask, d = ONES * (unsigned char)delim;
+
+    while (end - p >= (long)sizeof(x)) {
+        x = word_load(p);
+        if ((mask = word_below(x, 0x21) | word_zero(x ^ (ONES * 0x7f)) |
+                    word_zero(x ^ d)) != 0) {
+            return word_first(p, mask);
+        }
+        p += sizeof(x);
+    }
+    while (p < end && token_byte[(unsigned char)*p] && *p != delim) {
+        p++;
+    }
+    return p;
+}
+
+static const char *value_scalar(const char *p, const char *end) {
+    unsigned long x, mask;
+    const char *stop;
+
+    while (end - p >= (long)sizeof(x)) {
+        x = word_load(p);
+        if ((mask = word_below(x, 0x20) | word_zero(x ^ (ONES * 0x7f))) != 0) {
+            if (!word_zero(x ^ (ONES * '\t'))) {
+                return word_first(p, mask);
+            }
+            /* tabs are below 0x20 yet part of the value, so go byte by byte */
+            for (stop = p + sizeof(x); p < stop && value_byte[(unsigned char)*p]; p++) {
+            }
+            if (p < stop) {
+                return p;
+            }
+            continue;
+        }
+        p += sizeof(x);
+    }
+    while (p < end && value_byte[(unsigned char)*p]) {
+        p++;
+    }
+    return p;
+}
+
+#ifdef HTTP_X86
+/* the SIMD scanners stop at the first end byte or where less than a vector is left */
+
+__attribute__((target("sse4.2")))
+static const char *token_sse42(const char *p, const char *end, char delim) {
+    char spec[16] = { 0x00, ' ', 0x7f, 0x7f, delim, delim };
+    __m128i ranges = _mm_loadu_si128((const __m128i *)spec);
+    int i;
+
+    while (end - p >= 16) {
+        i = _mm_cmpestri(ranges, 6, _mm_loadu_si128((const __m128i *)p), 16,
+                         _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (i < 16) {
+            return p + i;
+        }
+        p += 16;
+    }
+    return p;
+}
+
+__attribute__((target("sse4.2")))
+static const char *value_sse42(const char *p, const char *end) {
+    static const char spec[16] = { 0x00, 0x08, 0x0a, 0x1f, 0x7f, 0x7f };
+    __m128i ranges = _mm_loadu_si128((const __m128i *)spec);
+    int i;
+
+    while (end - p >= 16) {
+        i = _mm_cmpestri(ranges, 6, _mm_loadu_si128((const __m128i *)p), 16,
+                         _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (i < 16) {
+            return p + i;
+        }
+        p += 16;
+    }
+    return p;
+}
+
+__attribute__((target("avx2")))
+static const char *token_avx2(const char *p, const char *end, char delim) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    const __m256i d = _mm256_set1_epi8(delim);
+    __m256i v, stop;
+    unsigned int mask;
+
+    while (end - p >= 32) {
+        v = _mm256_loadu_si256((const __m256i *)p);
+        /* v <= ' ' unsigned is max(v, ' ') == ' ' */
+        stop = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_max_epu8(v, space), space),
+                               _mm256_or_si256(_mm256_cmpeq_epi8(v, del),
+                                               _mm256_cmpeq_epi8(v, d)));
+        if ((mask = _mm256_movemask_epi8(stop)) != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return p;
+}
+
+__attribute__((target("avx2")))
+static const char *value_avx2(const char *p, const char *end) {
+    const __m256i us = _mm256_set1_epi8(0x1f);
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    __m256i v, ctl, stop;
+    unsigned int mask;
+
+    while (end - p >= 32) {
+        v = _mm256_loadu_si256((const __m256i *)p);
+        ctl = _mm256_cmpeq_epi8(_mm256_max_epu8(v, us), us);
+        stop = _mm256_or_si256(_mm256_andnot_si256(_mm256_cmpeq_epi8(v, tab), ctl),
+                               _mm256_cmpeq_epi8(v, del));
+        if ((mask = _mm256_movemask_epi8(stop)) != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return p;
+}
+#endif
+
+/*
+ * returns the end of the token at p, or end if it runs past the buffer.
+ * Most fields end within SCAN_SHORT bytes, where a vector does not pay
+ * for its setup, so the word scanner looks there first
+ */
+static const char *scan_token(const char *p, const char *end, char delim) {
+#ifdef HTTP_X86
+    const char *stop = (end - p > SCAN_SHORT) ? p + SCAN_SHORT : end;
+
+    if (http_simd != HTTP_SCALAR) {
+        if ((p = token_scalar(p, stop, delim)) < stop) {
+            return p;
+        }
+    }
+    if (http_simd == HTTP_AVX2) {
+        p = token_avx2(p, end, delim);
+    } else if (http_simd == HTTP_SSE42) {
+        p = token_sse42(p, end, delim);
+    }
+#endif
+    return token_scalar(p, end, delim);
+}
+
+/* returns the end of the header value at p like scan_token */
+static const char *scan_value(const char *p, const char *end) {
+#ifdef HTTP_X86
+    const char *stop = (end - p > SCAN_SHORT) ? p + SCAN_SHORT : end;
+
+    if (http_simd != HTTP_SCALAR) {
+        if ((p = value_scalar(p, stop)) < stop) {
+            return p;
+        }
+    }
+    if (http_simd == HTTP_AVX2) {
+        p = value_avx2(p, end);
+    } else if (http_simd == HTTP_SSE42) {
+        p = value_sse42(p, end);
+    }
+#endif
+    return value_scalar(p, end);
+}
+
+/* steps over the line end at *pp, returns 0 or a parse result */
+static int parse_eol(const char **pp, const char *end) {
+    const char *p = *pp;
+
+    if (p == end) {
+        return HTTP_INCOMPLETE;
+    }
+    if (*p == '\r') {
+        if (++p == end) {
+            return HTTP_INCOMPLETE;
+        }
+        if (*p != '\n') {
+            return HTTP_ERROR;
+        }
+    } else if (*p != '\n') {
+        return HTTP_ERROR;
+    }
+    *pp = p + 1;
+    return 0;
+}
+
+/* steps over "HTTP/1.x" at *pp, returns 0 or a parse result */
+static int parse_version(const char **pp, const char *end, int *minor) {
+    const char *p = *pp;
+
+    if (end - p < 8) {
+        return memcmp(p, "HTTP/1.", (end - p < 7) ? end - p : 7) ?
+            HTTP_ERROR : HTTP_INCOMPLETE;
+    }
+    if (memcmp(p, "HTTP/1.", 7) || p[7] < '0' || p[7] > '9') {
+        return HTTP_ERROR;
+    }
+    *minor = p[7] - '0';
+    *pp = p + 8;
+    return 0;
+}
+
+/* parses the header lines and the empty line at p, returns the head length */
+static int parse_headers(const char *buf, const char *p, const char *end,
+        Http_header_t *headers, int *nheaders) {
+    const char *tok, *tend;
+    Http_header_t *h;
+    int rc;
+
+    *nheaders = 0;
+    while (1) {
+        if (p == end) {
+            return HTTP_INCOMPLETE;
+        }
+        if (*p == '\r' || *p == '\n') {
+            if ((rc = parse_eol(&p, end)) < 0) {
+                return rc;
+            }
+            return p - buf;
+        }
+        /* line folding is obsolete and refused, as RFC 7230 allows */
+        if (*nheaders == HTTP_MAX_HEADERS || *p == ' ' || *p == '\t') {
+            return HTTP_ERROR;
+        }
+        h = &headers[*nheaders];
+
+        tok = p;
+        if ((p = scan_token(p, end, ':')) == end) {
+            return HTTP_INCOMPLETE;
+        }
+        if (*p != ':' || p == tok) {
+            return HTTP_ERROR;
+        }
+        h->name.p = tok;
+        h->name.len = p - tok;
+
+        for (p++; p < end && (*p == ' ' || *p == '\t'); p++) {
+        }
+        tok = p;
+        if ((p = scan_value(p, end)) == end) {
+            return HTTP_INCOMPLETE;
+        }
+        for (tend = p; tend > tok && (tend[-1] == ' ' || tend[-1] == '\t'); tend--) {
+        }
+        h->value.p = tok;
+        h->value.len = tend - tok;
+        if ((rc = parse_eol(&p, end)) < 0) {
+            return rc;
+        }
+        (*nheaders)++;
+    }
+}
+
+/*
+ * http_parse_request - parses the request head at the start of buf;
+ * returns the length of the head including its empty line,
+ * HTTP_INCOMPLETE or HTTP_ERROR
+ */
+int http_parse_request(const char *buf, size_t len, Http_request_t *req) {
+    const char *p = buf, *end = buf + len, *tok;
+    int rc;
+
+    req->nheaders = 0;
+
+    /* empty lines before the request line are ignored, RFC 7230 3.5 */
+    while (p < end && (*p == '\r' || *p == '\n')) {
+        p++;
+    }
+
+    tok = p;
+    if ((p = scan_token(p, end, ' ')) == end) {
+        return HTTP_INCOMPLETE;
+    }
+    if (*p != ' ' || p == tok) {
+        return HTTP_ERROR;
+    }
+    req->method.p = tok;
+    req->method.len = p - tok;
+
+    tok = ++p;
+    if ((p = scan_token(p, end, ' ')) == end) {
+        return HTTP_INCOMPLETE;
+    }
+    if (*p != ' ' || p == tok) {
+        return HTTP_ERROR;
+    }
+    req->target.p = tok;
+    req->target.len = p - tok;
+
+    p++;
+    if ((rc = parse_version(&p, end, &req->minor_version)) < 0 ||
+        (rc = parse_eol(&p, end)) < 0) {
+        return rc;
+    }
+    return parse_headers(buf, p, end, req->headers, &req->nheaders);
+}
+
+/*
+ * http_parse_response - parses the response head at the start of buf;
+ * returns the length of the head including its empty line,
+ * HTTP_INCOMPLETE or HTTP_ERROR
+ */
+int http_parse_response(const char *buf, size_t len, Http_response_t *resp) {
+    const char *p = buf, *end = buf + len, *tok;
+    int rc, i;
+
+    resp->nheaders = 0;
+
+    if ((rc = parse_version(&p, end, &resp->minor_version)) < 0) {
+        return rc;
+    }
+    if (end - p < 4) {
+        return HTTP_INCOMPLETE;
+    }
+    if (*p++ != ' ') {
+        return HTTP_ERROR;
+    }
+    for (resp->status = 0, i = 0; i < 3; i++, p++) {
+        if (*p < '0' || *p > '9') {
+            return HTTP_ERROR;
+        }
+        resp->status = resp->status * 10 + (*p - '0');
+    }
+
+    /* the reason phrase may be left out along with its space */
+    if (p < end && *p == ' ') {
+        p++;
+    }
+    tok = p;
+    if ((p = scan_value(p, end)) == end) {
+        return HTTP_INCOMPLETE;
+    }
+    resp->reason.p = tok;
+    resp->reason.len = p - tok;
+    if ((rc = parse_eol(&p, end)) < 0) {
+        return rc;
+    }
+    return parse_headers(buf, p, end, resp->headers, &resp->nheaders);
+}
+
+/*
+ * http_equal - returns 1 if the len bytes at p equal str, ignoring
+ * case; str may be longer
+ */
+int http_equal(const char *p, const char *str, size_t len) {
+    const char *end = p + len;
+    unsigned char diff;
+
+    /* ASCII case folding, stopping at the first difference */
+    for (; p < end; p++, str++) {
+        if ((diff = *p ^ *str) != 0 &&
+            (diff != 0x20 || (*str | 0x20) < 'a' || (*str | 0x20) > 'z')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * http_find_header - returns the value of the first header called name
+ * or NULL
+ */
+Http_slice_t *http_find_header(Http_header_t *headers, int n, const char *name) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (http_slice_is(&headers[i].name, name)) {
+            return &headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * http_has_token - returns 1 if the comma separated value lists token,
+ * ignoring case
+ */
+int http_has_token(const Http_slice_t *value, const char *token) {
+    const char *p = value->p, *end = value->p + value->len, *tok, *tend;
+    size_t len = strlen(token);
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
+        for (tok = p; p < end && *p != ','; p++) {
+        }
+        for (tend = p; tend > tok && (tend[-1] == ' ' || tend[-1] == '\t'); tend--) {
+        }
+        if (tend - tok == len && !strncasecmp(tok, token, len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * http_copy - copies the slice into dst of size bytes, null terminated;
+ * returns -1 if it does not fit
+ */
+int http_copy(char *dst, size_t size, const Http_slice_t *slice) {
+    if (slice->len >= size) {
+        return -1;
+    }
+    memcpy(dst, slice->p, slice->len);
+    dst[slice->len] = '\0';
+    return 0;
+}
+/*
+ * http_dechunk_init - starts de-chunking a body
+ */
+void http_dechunk_init(Http_dechunk_t *d) {
+    d->state = HTTP_CHUNK_SIZE;
+    d->left = 0;
+}
+
+/* returns the value of a hex digit or -1 */
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+/*
+ * http_dechunk - takes the next n bytes of a chunked body and moves the
+ * chunk data in them to the start of buf, dropping sizes, extensions and
+ * trailers; returns the data bytes. Bytes after the end of the body are
+ * dropped too
+ */
+size_t http_dechunk(Http_dechunk_t *d, char *buf, size_t n) {
+    char *in = buf, *end = buf + n, *out = buf;
+    size_t take;
+    int digit;
+
+    while (in < end) {
+        switch (d->state) {
+        case HTTP_CHUNK_SIZE:
+            if ((digit = hex_digit(*in)) >= 0) {
+                d->left = d->left * 16 + digit;
+                in++;
+                break;
+            }
+            d->state = HTTP_CHUNK_EXT;
+            /* fall through */
+        case HTTP_CHUNK_EXT:
+            if (*in++ == '\n') {
+                d->state = (d->left > 0) ? HTTP_CHUNK_DATA : HTTP_CHUNK_TRAILER;
+            }
+            break;
+        case HTTP_CHUNK_DATA:
+            take = (d->left < (size_t)(end - in)) ? d->left : (size_t)(end - in);
+            memmove(out, in, take);
+            out += take;
+            in += take;
+            if ((d->left -= take) == 0) {
+                d->state = HTTP_CHUNK_DATA_END;
+            }
+            break;
+        case HTTP_CHUNK_DATA_END:
+            if (*in++ == '\n') {
+                d->state = HTTP_CHUNK_SIZE;
+            }
+            break;
+        case HTTP_CHUNK_TRAILER:
+            if (*in == '\n') {
+                d->state = HTTP_CHUNK_DONE;
+            } else if (*in != '\r') {
+                d->state = HTTP_CHUNK_TRAILER_LINE;
+            }
+            in++;
+            break;
+        case HTTP_CHUNK_TRAILER_LINE:
+            if (*in++ == '\n') {
+                d->state = HTTP_CHUNK_TRAILER;
+            }
+            break;
+        default:
+            in = end;
+        }
+    }
+    return out - buf;
+}
+/* $end http.c */
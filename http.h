@@ -0,0 +1,116 @@
+/*
+ * http.h - single pass HTTP/1.x request and response head parser,
+ * definitions and prototypes.
+ */
+/* $begin http.h */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+
+#define HTTP_MAX_HEADERS 64  /* header lines a head may have */
+
+/* parse results other than the head length */
+#define HTTP_ERROR -1       /* the head is malformed or has too many headers */
+#define HTTP_INCOMPLETE -2  /* the head does not end within the buffer yet */
+
+/* states of Http_dechunk_t */
+#define HTTP_CHUNK_SIZE 0        /* in the hex size of a chunk */
+#define HTTP_CHUNK_EXT 1         /* in the rest of its size line */
+#define HTTP_CHUNK_DATA 2        /* in its data */
+#define HTTP_CHUNK_DATA_END 3    /* in the line end after the data */
+#define HTTP_CHUNK_TRAILER 4     /* at the start of a trailer line */
+#define HTTP_CHUNK_TRAILER_LINE 5
+#define HTTP_CHUNK_DONE 6        /* past the empty line that ends the body */
+
+/* scanners the parser can use, see http_simd */
+#define HTTP_SCALAR 0
+#define HTTP_SSE42 1
+#define HTTP_AVX2 2
+
+/* part of the parsed buffer, not null terminated */
+typedef struct Http_slice {
+    const char *p;
+    size_t len;
+} Http_slice_t;
+
+/* one header line, the value without surrounding whitespace */
+typedef struct Http_header {
+    Http_slice_t name;
+    Http_slice_t value;
+} Http_header_t;
+
+typedef struct Http_request {
+    Http_slice_t method;
+    Http_slice_t target;
+    int minor_version;  /* x of HTTP/1.x */
+    int nheaders;
+    Http_header_t headers[HTTP_MAX_HEADERS];
+} Http_request_t;
+
+typedef struct Http_response {
+    int minor_version;  /* x of HTTP/1.x */
+    int status;
+    Http_slice_t reason;
+    int nheaders;
+    Http_header_t headers[HTTP_MAX_HEADERS];
+} Http_response_t;
+
+/* where de-chunking a body has got to, bytes may come in any pieces */
+typedef struct Http_dechunk {
+    int state;
+    size_t left;  /* size of the chunk, then the data bytes left of it */
+} Http_dechunk_t;
+
+/* scanner in use, the best the cpu has after init_http */
+extern int http_simd;
+
+/* function prototypes */
+
+/* sets the parser up, before any parse */
+void init_http();
+
+/*
+ * parses the request head at the start of buf; returns the length of
+ * the head including its empty line, HTTP_INCOMPLETE or HTTP_ERROR
+ */
+int http_parse_request(const char *buf, size_t len, Http_request_t *req);
+
+/* parses a response head like http_parse_request */
+int http_parse_response(const char *buf, size_t len, Http_response_t *resp);
+
+/* returns 1 if the len bytes at p equal str, ignoring case */
+int http_equal(const char *p, const char *str, size_t len);
+
+/*
+ * returns 1 if the slice equals str, ignoring case. Header names are
+ * compared many times per request and nearly all differ in length, which
+ * the inlined check settles without a call
+ */
+static inline int http_slice_is(const Http_slice_t *slice, const char *str) {
+    return slice->len == strlen(str) && http_equal(slice->p, str, slice->len);
+}
+
+/* returns the value of the first header called name or NULL */
+Http_slice_t *http_find_header(Http_header_t *headers, int n, const char *name);
+
+/* returns 1 if the comma separated value lists token, ignoring case */
+int http_has_token(const Http_slice_t *value, const char *token);
+
+/*
+ * copies the slice into dst of size bytes, null terminated; returns -1
+ * if it does not fit
+ */
+int http_copy(char *dst, size_t size, const Http_slice_t *slice);
+
+/* starts de-chunking a body */
+void http_dechunk_init(Http_dechunk_t *d);
+
+/*
+ * takes the next n bytes of a chunked body and leaves the data in them
+ * at the start of buf; returns the data bytes
+ */
+size_t http_dechunk(Http_dechunk_t *d, char *buf, size_t n);
+
+#endif /* __HTTP_H__ */
+/* $end http.h */
@@ -0,0 +1,193 @@
+/*
+ * log.c - asynchronous logger with a lock-free ring per thread.
+ *
+ * Every thread that logs gets a ring of fixed size slots. A message is
+ * formatted straight into the next free slot and published with a
+ * release store of the tail, so logging costs a vsnprintf and takes no
+ * lock and no system call; when the ring is full the message is dropped
+ * and counted rather than making the thread wait. A flusher thread
+ * drains the rings every LOG_FLUSH_MS, stamps the lines with their time
+ * and level and writes them out in one write per pass. Lines of one
+ * thread stay in order; lines of different threads may interleave a
+ * little out of time order within a pass.
+ */
+/* $begin log.c */
+#include "log.h"
+#include "buf.h"
+
+int log_level = LOG_INFO;
+
+static int log_fd = -1;  /* -1 until the flusher runs */
+
+/* all rings, never freed, reused after their thread exits */
+static Log_ring_t *volatile rings;
+static sem_t rings_mutex;
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key;
+
+static const char *level_names[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+/* releases the ring of an exiting thread, what it logged is still flushed */
+static void log_thread_exit(void *arg) {
+    Log_ring_t *ring = (Log_ring_t *)arg;
+    __atomic_store_n(&ring->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void log_init_once() {
+    Sem_init(&rings_mutex, 0, 1);
+    pthread_key_create(&log_key, log_thread_exit);
+}
+
+/* returns the ring of the calling thread, registering it if needed */
+static Log_ring_t *log_self() {
+    static __thread Log_ring_t *self;
+    Log_ring_t *ring;
+
+    if (self != NULL) {
+        return self;
+    }
+    pthread_once(&log_once, log_init_once);
+
+    /* reuse the ring of an exited thread if there is one */
+    for (ring = rings; ring != NULL; ring = ring->next) {
+        if (!ring->in_use && __sync_bool_compare_and_swap(&ring->in_use, 0, 1)) {
+            break;
+        }
+    }
+    if (ring == NULL) {
+        ring = (Log_ring_t *)Calloc(1, sizeof(Log_ring_t));
+        ring->in_use = 1;
+        P(&rings_mutex);
+        ring->next = rings;
+        __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+        V(&rings_mutex);
+    }
+    pthread_setspecific(log_key, ring);
+    self = ring;
+    return ring;
+}
+
+static long wall_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/*
+ * log_msg - logs a printf formatted message without waiting, dropping
+ * it if the ring is full
+ */
+void log_msg(int level, const char *fmt, ...) {
+    Log_ring_t *ring;
+    Log_slot_t *slot;
+    unsigned long tail;
+    va_list ap;
+    int n;
+
+    if (level < log_level) {
+        return;
+    }
+    if (log_fd < 0) {
+        /* no flusher yet, as during startup */
+        va_start(ap, fmt);
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+        fputc('\n', stderr);
+        return;
+    }
+
+    ring = log_self();
+    tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == LOG_SLOTS) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    slot = &ring->slots[tail & (LOG_SLOTS - 1)];
+    va_start(ap, fmt);
+    n = vsnprintf(slot->text, LOG_SLOT_TEXT, fmt, ap);
+    va_end(ap);
+    slot->len = (n < 0) ? 0 : (n < LOG_SLOT_TEXT) ? n : LOG_SLOT_TEXT - 1;
+    slot->level = level;
+    slot->time_ms = wall_ms();
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* appends the waiting messages of a ring to out */
+static void drain(Log_ring_t *ring, Buf_t *out) {
+    unsigned long head = ring->head;
+    unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    unsigned long dropped;
+    Log_slot_t *slot;
+    char stamp[32];
+    time_t secs;
+    struct tm tm;
+
+    for (; head != tail; head++) {
+        slot = &ring->slots[head & (LOG_SLOTS - 1)];
+        secs = slot->time_ms / 1000;
+        localtime_r(&secs, &tm);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        buf_printf(out, "%s.%03ld %-5s ", stamp, slot->time_ms % 1000,
+                   level_names[slot->level]);
+        buf_append(out, slot->text, slot->len);
+        buf_append(out, "\n", 1);
+    }
+    /* the slots are copied out, the thread may fill them again */
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+    if ((dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED)) != 0) {
+        buf_printf(out, "log: %lu messages dropped, ring full\n", dropped);
+    }
+}
+
+/*
+ * log_flush - writes out every waiting message
+ */
+void log_flush() {
+    Log_ring_t *ring;
+    Buf_t out;
+
+    if (log_fd < 0) {
+        return;
+    }
+    buf_init(&out);
+    pthread_mutex_lock(&flush_mutex);
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL;
+         ring = ring->next) {
+        drain(ring, &out);
+    }
+    if (out.len > 0) {
+        rio_writen(log_fd, out.data, out.len);
+    }
+    pthread_mutex_unlock(&flush_mutex);
+    buf_free(&out);
+}
+
+/* writes the rings out forever */
+static void *flusher(void *arg) {
+    struct timespec pause = { 0, LOG_FLUSH_MS * 1000000L };
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        log_flush();
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+/*
+ * init_log - starts the flusher writing to fd, keeping messages of level
+ * and up; until then messages go straight to stderr
+ */
+void init_log(int fd, int level) {
+    pthread_t tid;
+
+    log_level = level;
+    log_fd = fd;
+    /* what is waiting is not lost when the proxy exits */
+    atexit(log_flush);
+    Pthread_create(&tid, NULL, flusher, NULL);
+}
+/* $end log.c */
@@ -0,0 +1,60 @@
+/*
+ * log.h - asynchronous logger with a lock-free ring per thread,
+ * definition and prototypes.
+ */
+/* $begin log.h */
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include "csapp.h"
+
+/* levels, a message is kept if its level is at least log_level */
+#define LOG_DEBUG 0
+#define LOG_INFO 1   /* the access log */
+#define LOG_WARN 2
+#define LOG_ERROR 3
+
+#define LOG_SLOTS 1024      /* messages a thread may have waiting, a power of 2 */
+#define LOG_SLOT_TEXT 240   /* longest message, longer ones are cut */
+#define LOG_FLUSH_MS 50     /* how often the flusher looks for messages */
+
+/* one message waiting in a ring */
+typedef struct Log_slot {
+    long time_ms;  /* wall clock when it was logged */
+    int level;
+    int len;
+    char text[LOG_SLOT_TEXT];
+} Log_slot_t;
+
+/*
+ * messages of one thread: the thread appends at tail, the flusher takes
+ * them from head; neither waits for the other
+ */
+typedef struct Log_ring {
+    Log_slot_t slots[LOG_SLOTS];
+    volatile unsigned long head;     /* next slot the flusher takes */
+    volatile unsigned long tail;     /* next slot the thread fills */
+    volatile unsigned long dropped;  /* messages lost to a full ring */
+    volatile int in_use;             /* 0 once its thread has exited */
+    struct Log_ring *next;
+} Log_ring_t;
+
+extern int log_level;
+
+/* function prototypes */
+
+/*
+ * starts the flusher writing to fd, keeping messages of level and up;
+ * until then messages go straight to stderr
+ */
+void init_log(int fd, int level);
+
+/* logs a printf formatted message without waiting, dropping it if the ring is full */
+void log_msg(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* writes out every waiting message */
+void log_flush();
+
+#endif /* __LOG_H__ */
+/* $end log.h */
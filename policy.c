@@ -0,0 +1,99 @@
+/*
+ * policy.c - eviction policy registry and ghost lists shared by the
+ * policies that remember recently evicted objects.
+ */
+/* $begin policy.c */
+#include "policy.h"
+
+/* all policies, NULL terminated */
+Policy_t *policy_list[] = {
+    &lfulru_policy,
+    &arc_policy,
+    &s3fifo_policy,
+    &gdsf_policy,
+    NULL
+};
+
+/* returns the policy with the given name, or NULL */
+Policy_t *find_policy(char *name) {
+    int i;
+    for (i = 0; policy_list[i] != NULL; i++) {
+        if (!strcasecmp(policy_list[i]->name, name)) {
+            return policy_list[i];
+        }
+    }
+    return NULL;
+}
+
+/* returns the bucket of a given hash, skipping the bits that pick the shard */
+static Ghost_t **ghost_bucket(Ghost_list_t *list, unsigned int hash) {
+    return &list->buckets[(hash / CACHE_SHARDS) & (GHOST_BUCKETS - 1)];
+}
+
+/* initializes an empty ghost list */
+void ghost_init(Ghost_list_t *list) {
+    memset(list, 0, sizeof(Ghost_list_t));
+}
+
+/* remembers an evicted object as the most recent ghost */
+void ghost_push(Ghost_list_t *list, unsigned int hash, size_t size) {
+    Ghost_t *ghost = (Ghost_t *)Malloc(sizeof(Ghost_t));
+    Ghost_t **bucket = ghost_bucket(list, hash);
+
+    ghost->hash = hash;
+    ghost->size = size;
+    ghost->hnext = *bucket;
+    *bucket = ghost;
+
+    ghost->prev = NULL;
+    ghost->next = list->head;
+    if (list->head != NULL) {
+        list->head->prev = ghost;
+    } else {
+        list->tail = ghost;
+    }
+    list->head = ghost;
+    list->len++;
+    list->size += size;
+}
+
+/* finds the ghost of the object with the given hash */
+Ghost_t *ghost_find(Ghost_list_t *list, unsigned int hash) {
+    Ghost_t *ghost = *ghost_bucket(list, hash);
+    while (ghost != NULL && ghost->hash != hash) {
+        ghost = ghost->hnext;
+    }
+    return ghost;
+}
+
+/* forgets a ghost */
+void ghost_remove(Ghost_list_t *list, Ghost_t *ghost) {
+    Ghost_t **pos = ghost_bucket(list, ghost->hash);
+    while (*pos != ghost) {
+        pos = &(*pos)->hnext;
+    }
+    *pos = ghost->hnext;
+
+    if (ghost->prev != NULL) {
+        ghost->prev->next = ghost->next;
+    } else {
+        list->head = ghost->next;
+    }
+    if (ghost->next != NULL) {
+        ghost->next->prev = ghost->prev;
+    } else {
+        list->tail = ghost->prev;
+    }
+    list->len--;
+    list->size -= ghost->size;
+    Free(ghost);
+}
+
+/* forgets the oldest ghost */
+void ghost_pop(Ghost_list_t *list) {
+    if (list->tail != NULL) {
+        ghost_remove(list, list->tail);
+    }
+}
+
+/* $end policy.c */
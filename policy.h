@@ -0,0 +1,60 @@
+/*
+ * policy.h - eviction policies for the cache, definition and prototypes.
+ */
+/* $begin policy.h */
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+#include "cache.h"
+
+#define GHOST_BUCKETS 256
+
+/* ghost entry, remembers the hash and size of an evicted object */
+typedef struct Ghost {
+    struct Ghost *prev;   /* toward the most recent entry */
+    struct Ghost *next;   /* toward the oldest entry */
+    struct Ghost *hnext;  /* next entry in the same bucket */
+    unsigned int hash;
+    size_t size;
+} Ghost_t;
+
+/* list of ghost entries in eviction order, indexed by hash */
+typedef struct Ghost_list {
+    Ghost_t *head;  /* most recent */
+    Ghost_t *tail;  /* oldest */
+    Ghost_t *buckets[GHOST_BUCKETS];
+    int len;
+    size_t size;    /* total size of the objects remembered */
+} Ghost_list_t;
+
+/* available policies */
+extern Policy_t lfulru_policy;  /* small LFU in front of an LRU (default) */
+extern Policy_t arc_policy;     /* adaptive replacement cache, byte sized */
+extern Policy_t s3fifo_policy;  /* small, main and ghost FIFO queues */
+extern Policy_t gdsf_policy;    /* greedy dual size frequency */
+
+/* all policies, NULL terminated */
+extern Policy_t *policy_list[];
+
+/* function prototypes */
+
+/* returns the policy with the given name, or NULL */
+Policy_t *find_policy(char *name);
+
+/* initializes an empty ghost list */
+void ghost_init(Ghost_list_t *list);
+
+/* remembers an evicted object as the most recent ghost */
+void ghost_push(Ghost_list_t *list, unsigned int hash, size_t size);
+
+/* finds the ghost of the object with the given hash */
+Ghost_t *ghost_find(Ghost_list_t *list, unsigned int hash);
+
+/* forgets a ghost */
+void ghost_remove(Ghost_list_t *list, Ghost_t *ghost);
+
+/* forgets the oldest ghost */
+void ghost_pop(Ghost_list_t *list);
+
+#endif /* __POLICY_H__ */
+/* $end policy.h */
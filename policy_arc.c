@@ -0,0 +1,153 @@
+/*
+ * policy_arc.c - adaptive replacement cache (Megiddo and Modha) measured
+ * in bytes instead of entries.
+ *
+ * T1 holds objects seen once recently and T2 objects seen at least twice.
+ * B1 and B2 remember what was evicted from them. A miss that hits B1 means
+ * T1 was too small and grows the target size p of T1, a miss that hits B2
+ * shrinks it. Victims come from T1 while it is larger than p.
+ */
+/* $begin policy_arc.c */
+#include "policy.h"
+
+#define IN_T1 1
+#define IN_T2 2
+
+typedef struct Arc {
+    Node_t *T1_head;
+    Node_t *T1_tail;
+    size_t T1_size;
+
+    Node_t *T2_head;
+    Node_t *T2_tail;
+    size_t T2_size;
+
+    Ghost_list_t B1;
+    Ghost_list_t B2;
+
+    size_t p;      /* target size of T1 in bytes */
+    int b2_hit;    /* the last insert was found in B2 */
+} Arc_t;
+
+/* keeps T1 + B1 within the capacity and the whole directory within twice it */
+static void arc_trim(Arc_t *arc) {
+    while (arc->B1.len > 0 && arc->T1_size + arc->B1.size > SHARD_CAPACITY) {
+        ghost_pop(&arc->B1);
+    }
+    while (arc->B2.len > 0 && arc->T1_size + arc->T2_size + arc->B1.size +
+           arc->B2.size > 2 * SHARD_CAPACITY) {
+        ghost_pop(&arc->B2);
+    }
+}
+
+static void arc_init(Shard_t *shard) {
+    Arc_t *arc = (Arc_t *)Calloc(1, sizeof(Arc_t));
+    init_list(&arc->T1_head, &arc->T1_tail);
+    init_list(&arc->T2_head, &arc->T2_tail);
+    ghost_init(&arc->B1);
+    ghost_init(&arc->B2);
+    shard->policy_data = arc;
+}
+
+static void arc_insert(Shard_t *shard, Node_t *cur) {
+    Arc_t *arc = (Arc_t *)shard->policy_data;
+    Ghost_t *ghost;
+    size_t delta;
+
+    arc->b2_hit = 0;
+    if ((ghost = ghost_find(&arc->B1, cur->hash)) != NULL) {
+        /* T1 evicted it too early */
+        delta = cur->size;
+        if (arc->B2.size > arc->B1.size) {
+            delta *= arc->B2.size / arc->B1.size;
+        }
+        arc->p = (arc->p + delta < SHARD_CAPACITY) ? arc->p + delta : SHARD_CAPACITY;
+        ghost_remove(&arc->B1, ghost);
+    } else if ((ghost = ghost_find(&arc->B2, cur->hash)) != NULL) {
+        /* T2 evicted it too early */
+        delta = cur->size;
+        if (arc->B1.size > arc->B2.size) {
+            delta *= arc->B1.size / arc->B2.size;
+        }
+        arc->p = (arc->p > delta) ? arc->p - delta : 0;
+        arc->b2_hit = 1;
+        ghost_remove(&arc->B2, ghost);
+    }
+
+    if (ghost != NULL) {
+        cur->list = IN_T2;
+        insert_node(cur, arc->T2_head);
+        arc->T2_size += cur->size;
+    } else {
+        cur->list = IN_T1;
+        insert_node(cur, arc->T1_head);
+        arc->T1_size += cur->size;
+    }
+    arc_trim(arc);
+}
+
+static void arc_hit(Shard_t *shard, Node_t *cur) {
+    Arc_t *arc = (Arc_t *)shard->policy_data;
+    if (cur->list == IN_T1) {
+        arc->T1_size -= cur->size;
+        arc->T2_size += cur->size;
+        cur->list = IN_T2;
+    }
+    move_node(cur, arc->T2_head);
+}
+
+static Node_t *arc_victim(Shard_t *shard) {
+    Arc_t *arc = (Arc_t *)shard->policy_data;
+    int T1_empty = (arc->T1_head->next == arc->T1_tail);
+    int T2_empty = (arc->T2_head->next == arc->T2_tail);
+
+    if (!T1_empty && (T2_empty || arc->T1_size > arc->p ||
+                      (arc->b2_hit && arc->T1_size == arc->p))) {
+        return arc->T1_tail->prev;
+    }
+    if (!T2_empty) {
+        return arc->T2_tail->prev;
+    }
+    return NULL;
+}
+
+static void arc_remove(Shard_t *shard, Node_t *cur) {
+    Arc_t *arc = (Arc_t *)shard->policy_data;
+    remove_node(cur);
+    if (cur->list == IN_T1) {
+        arc->T1_size -= cur->size;
+        ghost_push(&arc->B1, cur->hash, cur->size);
+    } else {
+        arc->T2_size -= cur->size;
+        ghost_push(&arc->B2, cur->hash, cur->size);
+    }
+    arc_trim(arc);
+}
+
+static void arc_destroy(Shard_t *shard) {
+    Arc_t *arc = (Arc_t *)shard->policy_data;
+    while (arc->B1.len > 0) {
+        ghost_pop(&arc->B1);
+    }
+    while (arc->B2.len > 0) {
+        ghost_pop(&arc->B2);
+    }
+    Free(arc->T1_head);
+    Free(arc->T1_tail);
+    Free(arc->T2_head);
+    Free(arc->T2_tail);
+    Free(arc);
+}
+
+Policy_t arc_policy = {
+    "arc",
+    arc_init,
+    arc_insert,
+    arc_hit,
+    arc_victim,
+    arc_victim,
+    arc_remove,
+    arc_destroy
+};
+
+/* $end policy_arc.c */
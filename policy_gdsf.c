@@ -0,0 +1,121 @@
+/*
+ * policy_gdsf.c - greedy dual size frequency (Cherkasova).
+ *
+ * Every node gets the priority L + count / size, where L is the priority
+ * of the last victim. The node with the lowest priority is evicted, so
+ * small and frequently hit objects stay while L ages out old favourites.
+ * Nodes are kept in a binary min-heap on priority.
+ */
+/* $begin policy_gdsf.c */
+#include "policy.h"
+
+typedef struct Gdsf {
+    Node_t **heap;
+    int len;
+    int cap;
+    double clock;  /* L, priority of the last victim */
+} Gdsf_t;
+
+static void heap_swap(Gdsf_t *gdsf, int i, int j) {
+    Node_t *tmp = gdsf->heap[i];
+    gdsf->heap[i] = gdsf->heap[j];
+    gdsf->heap[j] = tmp;
+    gdsf->heap[i]->index = i;
+    gdsf->heap[j]->index = j;
+}
+
+static void sift_up(Gdsf_t *gdsf, int i) {
+    while (i > 0 && gdsf->heap[i]->priority < gdsf->heap[(i - 1) / 2]->priority) {
+        heap_swap(gdsf, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void sift_down(Gdsf_t *gdsf, int i) {
+    for (;;) {
+        int min = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < gdsf->len && gdsf->heap[left]->priority < gdsf->heap[min]->priority) {
+            min = left;
+        }
+        if (right < gdsf->len && gdsf->heap[right]->priority < gdsf->heap[min]->priority) {
+            min = right;
+        }
+        if (min == i) {
+            return;
+        }
+        heap_swap(gdsf, i, min);
+        i = min;
+    }
+}
+
+/* sets the priority of node cur from its count and size */
+static void set_priority(Gdsf_t *gdsf, Node_t *cur) {
+    cur->priority = gdsf->clock + (double)cur->count / (cur->size ? cur->size : 1);
+}
+
+static void gdsf_init(Shard_t *shard) {
+    Gdsf_t *gdsf = (Gdsf_t *)Calloc(1, sizeof(Gdsf_t));
+    gdsf->cap = 64;
+    gdsf->heap = (Node_t **)Malloc(gdsf->cap * sizeof(Node_t *));
+    shard->policy_data = gdsf;
+}
+
+static void gdsf_insert(Shard_t *shard, Node_t *cur) {
+    Gdsf_t *gdsf = (Gdsf_t *)shard->policy_data;
+    if (gdsf->len == gdsf->cap) {
+        gdsf->cap *= 2;
+        gdsf->heap = (Node_t **)Realloc(gdsf->heap, gdsf->cap * sizeof(Node_t *));
+    }
+    cur->count = 1;
+    set_priority(gdsf, cur);
+    cur->index = gdsf->len;
+    gdsf->heap[gdsf->len++] = cur;
+    sift_up(gdsf, cur->index);
+}
+
+static void gdsf_hit(Shard_t *shard, Node_t *cur) {
+    Gdsf_t *gdsf = (Gdsf_t *)shard->policy_data;
+    cur->count++;
+    set_priority(gdsf, cur);
+    sift_down(gdsf, cur->index);
+}
+
+static Node_t *gdsf_victim(Shard_t *shard) {
+    Gdsf_t *gdsf = (Gdsf_t *)shard->policy_data;
+    return (gdsf->len > 0) ? gdsf->heap[0] : NULL;
+}
+
+static void gdsf_remove(Shard_t *shard, Node_t *cur) {
+    Gdsf_t *gdsf = (Gdsf_t *)shard->policy_data;
+    int i = cur->index;
+
+    if (cur->priority > gdsf->clock) {
+        gdsf->clock = cur->priority;
+    }
+    gdsf->len--;
+    if (i != gdsf->len) {
+        heap_swap(gdsf, i, gdsf->len);
+        sift_down(gdsf, i);
+        sift_up(gdsf, i);
+    }
+    cur->index = -1;
+}
+
+static void gdsf_destroy(Shard_t *shard) {
+    Gdsf_t *gdsf = (Gdsf_t *)shard->policy_data;
+    Free(gdsf->heap);
+    Free(gdsf);
+}
+
+Policy_t gdsf_policy = {
+    "gdsf",
+    gdsf_init,
+    gdsf_insert,
+    gdsf_hit,
+    gdsf_victim,
+    gdsf_victim,
+    gdsf_remove,
+    gdsf_destroy
+};
+
+/* $end policy_gdsf.c */
@@ -0,0 +1,254 @@
+/*
+ * policy_lfulru.c - the default eviction policy: a small LFU of the most
+ * requested objects in front of an LRU of everything else.
+ *
+ * New objects enter the LRU. A hit on an LRU node promotes it to the LFU
+ * when the LFU has room or the node's count beats the LFU minimum. LFU
+ * nodes sit in frequency buckets so every step is O(1). Buckets are also
+ * indexed by count, with a two level bitmap of the counts in use, so a
+ * promoted node finds the bucket of its count, or the one to follow, in
+ * a few bit scans however many buckets the LFU has.
+ */
+/* $begin policy_lfulru.c */
+#include "policy.h"
+
+#define IN_LRU 0
+#define IN_LFU 1
+
+/*
+ * counts with a bucket of their own, a multiple of 64 up to 64 * 64;
+ * nodes accessed more often keep their count but share the last bucket
+ */
+#define LFU_COUNTS 4096
+#define LFU_WORDS (LFU_COUNTS / 64)
+
+/*
+ * LFU frequency bucket, holds the LFU nodes accessed exactly count times,
+ * most recently accessed first. Buckets are kept in ascending count order.
+ */
+typedef struct Freq {
+    struct Freq *prev;
+    struct Freq *next;
+    Node_t *head;
+    Node_t *tail;
+    int count;
+} Freq_t;
+
+typedef struct Lfulru {
+    /* LFU cache */
+    Freq_t *LFU_freq;  /* bucket with the lowest count */
+    int LFU_len;
+    size_t LFU_size;
+    Freq_t *LFU_count[LFU_COUNTS];  /* bucket of each count, NULL if none */
+    uint64_t LFU_used[LFU_WORDS];   /* bit per count with a bucket */
+    uint64_t LFU_used_words;        /* bit per nonzero word of LFU_used */
+
+    /* LRU cache */
+    Node_t *LRU_head;
+    Node_t *LRU_tail;
+    int LRU_len;
+    size_t LRU_size;
+} Lfulru_t;
+
+/* returns the bucket count a node accessed count times belongs in */
+static int freq_key(int count) {
+    return (count < LFU_COUNTS) ? count : LFU_COUNTS - 1;
+}
+
+/* returns the highest count below key that has a bucket, or -1 */
+static int freq_below(Lfulru_t *lfulru, int key) {
+    int w = key / 64;
+    uint64_t bits = lfulru->LFU_used[w] & ((1ULL << (key % 64)) - 1);
+
+    if (bits == 0) {
+        bits = lfulru->LFU_used_words & ((1ULL << w) - 1);
+        if (bits == 0) {
+            return -1;
+        }
+        w = 63 - __builtin_clzll(bits);
+        bits = lfulru->LFU_used[w];
+    }
+    return w * 64 + 63 - __builtin_clzll(bits);
+}
+
+/*
+ * returns the bucket for key that directly follows bucket prev (or
+ * starts the list if prev is NULL), creating it if needed
+ */
+static Freq_t *get_freq(Lfulru_t *lfulru, Freq_t *prev, int key) {
+    Freq_t *next = (prev != NULL) ? prev->next : lfulru->LFU_freq;
+    if (lfulru->LFU_count[key] != NULL) {
+        return lfulru->LFU_count[key];
+    }
+    Freq_t *freq = (Freq_t *)Malloc(sizeof(Freq_t));
+    freq->count = key;
+    freq->head = NULL;
+    freq->tail = NULL;
+    freq->prev = prev;
+    freq->next = next;
+    if (prev != NULL) {
+        prev->next = freq;
+    } else {
+        lfulru->LFU_freq = freq;
+    }
+    if (next != NULL) {
+        next->prev = freq;
+    }
+    lfulru->LFU_count[key] = freq;
+    lfulru->LFU_used[key / 64] |= 1ULL << (key % 64);
+    lfulru->LFU_used_words |= 1ULL << (key / 64);
+    return freq;
+}
+
+/* links LFU node cur at the front of bucket freq */
+static void freq_push(Freq_t *freq, Node_t *cur) {
+    cur->freq = freq;
+    cur->prev = NULL;
+    cur->next = freq->head;
+    if (freq->head != NULL) {
+        freq->head->prev = cur;
+    } else {
+        freq->tail = cur;
+    }
+    freq->head = cur;
+}
+
+/* unlinks LFU node cur from its bucket, freeing the bucket once empty */
+static void freq_unlink(Lfulru_t *lfulru, Node_t *cur) {
+    Freq_t *freq = cur->freq;
+    int key = freq->count;
+
+    if (cur->prev != NULL) {
+        cur->prev->next = cur->next;
+    } else {
+        freq->head = cur->next;
+    }
+    if (cur->next != NULL) {
+        cur->next->prev = cur->prev;
+    } else {
+        freq->tail = cur->prev;
+    }
+    cur->freq = NULL;
+
+    if (freq->head == NULL) {
+        if (freq->prev != NULL) {
+            freq->prev->next = freq->next;
+        } else {
+            lfulru->LFU_freq = freq->next;
+        }
+        if (freq->next != NULL) {
+            freq->next->prev = freq->prev;
+        }
+        lfulru->LFU_count[key] = NULL;
+        if ((lfulru->LFU_used[key / 64] &= ~(1ULL << (key % 64))) == 0) {
+            lfulru->LFU_used_words &= ~(1ULL << (key / 64));
+        }
+        Free(freq);
+    }
+}
+
+static void lfulru_init(Shard_t *shard) {
+    Lfulru_t *lfulru = (Lfulru_t *)Calloc(1, sizeof(Lfulru_t));
+    init_list(&lfulru->LRU_head, &lfulru->LRU_tail);
+    shard->policy_data = lfulru;
+}
+
+static void lfulru_insert(Shard_t *shard, Node_t *cur) {
+    Lfulru_t *lfulru = (Lfulru_t *)shard->policy_data;
+    cur->list = IN_LRU;
+    insert_node(cur, lfulru->LRU_head);
+    lfulru->LRU_len++;
+    lfulru->LRU_size += cur->size;
+}
+
+/*
+ * an LFU hit moves the node to the next bucket, and a node promoted from
+ * LRU joins the bucket of its count
+ */
+static void lfulru_hit(Shard_t *shard, Node_t *cur) {
+    Lfulru_t *lfulru = (Lfulru_t *)shard->policy_data;
+    Freq_t *freq, *lowest;
+    int key, below;
+
+    cur->count++;
+    key = freq_key(cur->count);
+
+    if (cur->list == IN_LFU) {
+        /* uri in LFU */
+        freq = cur->freq;
+        if (key != freq->count) {
+            freq = get_freq(lfulru, freq, key);
+        } else if (freq->head == cur) {
+            /* past LFU_COUNTS, already first in the shared bucket */
+            return;
+        }
+        freq_unlink(lfulru, cur);
+        freq_push(freq, cur);
+        return;
+    }
+
+    /* uri in LRU */
+    lowest = lfulru->LFU_freq;
+    if (lfulru->LFU_len < MAX_LFU_LEN || key > lowest->count) {
+        below = freq_below(lfulru, key);
+        freq = get_freq(lfulru, (below >= 0) ? lfulru->LFU_count[below] : NULL, key);
+        remove_node(cur);
+        lfulru->LRU_size -= cur->size;
+        lfulru->LRU_len--;
+
+        freq_push(freq, cur);
+        cur->list = IN_LFU;
+        lfulru->LFU_size += cur->size;
+        lfulru->LFU_len++;
+        while (lfulru->LFU_len > MAX_LFU_LEN) {
+            evict_node(shard, lfulru->LFU_freq->tail);
+        }
+    } else {
+        move_node(cur, lfulru->LRU_head);
+    }
+}
+
+/* evicts from LRU first, LFU only once LRU is empty */
+static Node_t *lfulru_victim(Shard_t *shard) {
+    Lfulru_t *lfulru = (Lfulru_t *)shard->policy_data;
+    if (lfulru->LRU_len > 0) {
+        return lfulru->LRU_tail->prev;
+    }
+    if (lfulru->LFU_len > 0) {
+        return lfulru->LFU_freq->tail;
+    }
+    return NULL;
+}
+
+static void lfulru_remove(Shard_t *shard, Node_t *cur) {
+    Lfulru_t *lfulru = (Lfulru_t *)shard->policy_data;
+    if (cur->list == IN_LFU) {
+        freq_unlink(lfulru, cur);
+        lfulru->LFU_size -= cur->size;
+        lfulru->LFU_len--;
+    } else {
+        remove_node(cur);
+        lfulru->LRU_size -= cur->size;
+        lfulru->LRU_len--;
+    }
+}
+
+static void lfulru_destroy(Shard_t *shard) {
+    Lfulru_t *lfulru = (Lfulru_t *)shard->policy_data;
+    Free(lfulru->LRU_head);
+    Free(lfulru->LRU_tail);
+    Free(lfulru);
+}
+
+Policy_t lfulru_policy = {
+    "lfulru",
+    lfulru_init,
+    lfulru_insert,
+    lfulru_hit,
+    lfulru_victim,
+    lfulru_victim,
+    lfulru_remove,
+    lfulru_destroy
+};
+
+/* $end policy_lfulru.c */
@@ -0,0 +1,172 @@
+/*
+ * policy_s3fifo.c - S3-FIFO (Yang et al.): a small FIFO that filters out
+ * one-hit wonders, a main FIFO with lazy reinsertion, and a ghost FIFO.
+ *
+ * New objects enter the small queue unless the ghost queue remembers
+ * them. Objects leaving the small queue move to the main queue if they
+ * were hit, otherwise they are evicted and remembered as ghosts. Objects
+ * leaving the main queue get reinserted while their count is above zero,
+ * losing one each time.
+ */
+/* $begin policy_s3fifo.c */
+#include "policy.h"
+
+#define IN_SMALL 1
+#define IN_MAIN 2
+
+#define S3FIFO_SMALL_SIZE (SHARD_CAPACITY / 10)  /* target size of the small queue */
+#define S3FIFO_MAX_COUNT 3
+
+typedef struct S3fifo {
+    Node_t *S_head;   /* small queue, newest first */
+    Node_t *S_tail;
+    int S_len;
+    size_t S_size;
+
+    Node_t *M_head;   /* main queue, newest first */
+    Node_t *M_tail;
+    int M_len;
+    size_t M_size;
+
+    Ghost_list_t G;
+} S3fifo_t;
+
+static void s3fifo_init(Shard_t *shard) {
+    S3fifo_t *s3fifo = (S3fifo_t *)Calloc(1, sizeof(S3fifo_t));
+    init_list(&s3fifo->S_head, &s3fifo->S_tail);
+    init_list(&s3fifo->M_head, &s3fifo->M_tail);
+    ghost_init(&s3fifo->G);
+    shard->policy_data = s3fifo;
+}
+
+static void s3fifo_insert(Shard_t *shard, Node_t *cur) {
+    S3fifo_t *s3fifo = (S3fifo_t *)shard->policy_data;
+    Ghost_t *ghost = ghost_find(&s3fifo->G, cur->hash);
+
+    cur->count = 0;
+    if (ghost != NULL) {
+        ghost_remove(&s3fifo->G, ghost);
+        cur->list = IN_MAIN;
+        insert_node(cur, s3fifo->M_head);
+        s3fifo->M_len++;
+        s3fifo->M_size += cur->size;
+    } else {
+        cur->list = IN_SMALL;
+        insert_node(cur, s3fifo->S_head);
+        s3fifo->S_len++;
+        s3fifo->S_size += cur->size;
+    }
+}
+
+static void s3fifo_hit(Shard_t *shard, Node_t *cur) {
+    if (cur->count < S3FIFO_MAX_COUNT) {
+        cur->count++;
+    }
+}
+
+/* moves the small queue's oldest node to the main queue */
+static void s3fifo_promote(S3fifo_t *s3fifo, Node_t *cur) {
+    move_node(cur, s3fifo->M_head);
+    cur->list = IN_MAIN;
+    cur->count = 0;
+    s3fifo->S_len--;
+    s3fifo->S_size -= cur->size;
+    s3fifo->M_len++;
+    s3fifo->M_size += cur->size;
+}
+
+/*
+ * finds the next victim, promoting hit nodes out of the small queue and
+ * reinserting hit nodes in the main queue on the way
+ */
+static Node_t *s3fifo_victim(Shard_t *shard) {
+    S3fifo_t *s3fifo = (S3fifo_t *)shard->policy_data;
+    Node_t *tmp;
+
+    while (s3fifo->S_len > 0 || s3fifo->M_len > 0) {
+        tmp = s3fifo->S_tail->prev;
+        if (s3fifo->S_len > 0 && (s3fifo->M_len == 0 ||
+            s3fifo->S_size >= S3FIFO_SMALL_SIZE)) {
+            if (tmp->count == 0) {
+                return tmp;
+            }
+            s3fifo_promote(s3fifo, tmp);
+        } else {
+            tmp = s3fifo->M_tail->prev;
+            if (tmp->count == 0) {
+                return tmp;
+            }
+            tmp->count--;
+            move_node(tmp, s3fifo->M_head);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * finds the node s3fifo_victim would evict without moving any: the oldest
+ * node without hits in the queue it draws from, or the oldest of all if
+ * every node there was hit
+ */
+static Node_t *s3fifo_peek(Shard_t *shard) {
+    S3fifo_t *s3fifo = (S3fifo_t *)shard->policy_data;
+    Node_t *head, *tail, *tmp;
+
+    if (s3fifo->S_len > 0 && (s3fifo->M_len == 0 ||
+        s3fifo->S_size >= S3FIFO_SMALL_SIZE)) {
+        head = s3fifo->S_head;
+        tail = s3fifo->S_tail;
+    } else if (s3fifo->M_len > 0) {
+        head = s3fifo->M_head;
+        tail = s3fifo->M_tail;
+    } else {
+        return NULL;
+    }
+    for (tmp = tail->prev; tmp != head; tmp = tmp->prev) {
+        if (tmp->count == 0) {
+            return tmp;
+        }
+    }
+    return tail->prev;
+}
+
+static void s3fifo_remove(Shard_t *shard, Node_t *cur) {
+    S3fifo_t *s3fifo = (S3fifo_t *)shard->policy_data;
+    remove_node(cur);
+    if (cur->list == IN_SMALL) {
+        s3fifo->S_len--;
+        s3fifo->S_size -= cur->size;
+        ghost_push(&s3fifo->G, cur->hash, cur->size);
+        while (s3fifo->G.size > SHARD_CAPACITY) {
+            ghost_pop(&s3fifo->G);
+        }
+    } else {
+        s3fifo->M_len--;
+        s3fifo->M_size -= cur->size;
+    }
+}
+
+static void s3fifo_destroy(Shard_t *shard) {
+    S3fifo_t *s3fifo = (S3fifo_t *)shard->policy_data;
+    while (s3fifo->G.len > 0) {
+        ghost_pop(&s3fifo->G);
+    }
+    Free(s3fifo->S_head);
+    Free(s3fifo->S_tail);
+    Free(s3fifo->M_head);
+    Free(s3fifo->M_tail);
+    Free(s3fifo);
+}
+
+Policy_t s3fifo_policy = {
+    "s3fifo",
+    s3fifo_init,
+    s3fifo_insert,
+    s3fifo_hit,
+    s3fifo_victim,
+    s3fifo_peek,
+    s3fifo_remove,
+    s3fifo_destroy
+};
+
+/* $end policy_s3fifo.c */
@@ -4,24 +4,105 @@
 /* $begin proxy.c */
 #include "csapp.h"
 #include "cache.h"
+#include "policy.h"
+#include "flight.h"
+#include "proxy.h"
+#include "event.h"
+#include "uring.h"
+#include "relay.h"
+#include "upstream.h"
+#include "dns.h"
+#include "connect.h"
+#include "sbuf.h"
+#include "log.h"
+#include "stats.h"
+
+#define NTHREADS 16  /* default number of worker threads */
+#define SBUFSIZE 64  /* default depth of the connection queue */
+#define HANDOFF_RETRY 10  /* milliseconds between tries to queue ready parked connections */
+
+/* failures of an origin fetch */
+#define FETCH_FAILED -1   /* the client already got part of the response */
+#define FETCH_CLOSED -2   /* the origin closed before answering */
+#define FETCH_TIMEOUT -3  /* the deadline passed before the origin answered */
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 
-static const char *user_agent_name = "User-Agent: ";
-static const char *host_name = "Host: ";
-static const char *connection_name = "Connection: ";
-static const char *proxy_connection_name = "Proxy-Connection: ";
-
-void *handle_client_request(void *arg);
-int handle_server_response(int fd_server, int fd_client, char *response);
-void parse_uri(char *uri, char *host, char *port, char *query);
-void construct_request(char *request, const char *method, const char *query,
-        const char *version, const char *user_agent, const char *host,
-        const char *connection, const char *proxy_connection, rio_t *rio);
+/* how the body of a response is framed, see response_body */
+#define BODY_NONE 0     /* the status has no body */
+#define BODY_LENGTH 1   /* Content-Length */
+#define BODY_CHUNKED 2  /* chunked transfer encoding */
+#define BODY_CLOSE 3    /* the end of the connection */
+
+/* length arguments of append_head other than a Content-Length */
+#define FRAMING_KEEP -2   /* Content-Length and Transfer-Encoding as they are */
+#define FRAMING_CLOSE -1  /* neither, the body ends with the connection */
+
+/* client headers the proxy sets itself */
+static const char *replaced_headers[] = {
+    "User-Agent", "Host", "Connection", "Proxy-Connection", NULL
+};
+
+/* response headers about one connection, besides those Connection names */
+static const char *hop_headers[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Upgrade", NULL
+};
+
+/* a response on its way to the client */
+typedef struct Reply {
+    int fd;
+    int minor_version;   /* x of the client's HTTP/1.x */
+    int keepalive;       /* the connection stays open after it */
+    int status;          /* status code the client got, 0 if none */
+    long first_byte;     /* when the head went on, microseconds, 0 if it did not */
+    size_t sent;         /* bytes written to the client */
+    int dechunking;      /* the body is chunked and the client is HTTP/1.0 */
+    Http_dechunk_t dechunk;
+} Reply_t;
+
+void usage(char *prog);
+void *stop(void *arg);
+void *worker(void *arg);
+void init_parking();
+void park_connection(int fd_client);
+void *idle_watcher(void *arg);
+void handle_client_request(int fd_client);
+int serve_request(int fd_client, rio_t *rio, char *client, long accepted);
+int serve_stats(int fd_client, char *client, int keepalive);
+int fetch_response(Buf_t *request, char *host, char *port, Reply_t *reply,
+        Flight_t *flight);
+int handle_server_response(int fd_server, Reply_t *reply, Flight_t *flight,
+        int *reusable, Deadline_t *deadline);
+void relay_flight(Flight_t *flight, Flight_reader_t *reader, Reply_t *reply);
 void client_error(int fd, char *cause, char *errnum,
         char *shortmsg, char *longmsg);
 
+static sbuf_t sbuf;  /* accepted connections waiting for a worker */
+int client_idle_timeout = CLIENT_IDLE_TIMEOUT;  /* 0 closes after each response */
+
+/* when each descriptor was accepted, microseconds, for the first byte histogram */
+static long *accepted_at;
+static int accepted_max;
+
+/* a connection parked between requests, in the order they time out */
+typedef struct Parked {
+    int fd;
+    long until;  /* milliseconds */
+} Parked_t;
+
+/*
+ * persistent connections idle between requests wait in park_epfd instead
+ * of in a worker; idle_until holds each parked descriptor's deadline, 0
+ * if it is not parked, and parked the deadlines in order, stale ones
+ * included, since every connection idles for the same time
+ */
+static int park_epfd;
+static long *idle_until;
+static Parked_t *parked;
+static int parked_head, parked_len, parked_size;
+static pthread_mutex_t park_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 int main(int argc, char **argv) {
     signal(SIGPIPE, SIG_IGN);
     signal(EPIPE, SIG_IGN);
@@ -29,113 +110,1034 @@ int main(int argc, char **argv) {
     char hostname[MAXLINE], port[MAXLINE];
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
+    int opt, event_mode = 0, uring_mode = 0, reactors = -1, pin = 0;
+    int nthreads = NTHREADS, sbufsize = SBUFSIZE, i;
+    int log_fd = STDOUT_FILENO, level = LOG_INFO;
+    static sigset_t stop_signals;
+    pthread_t tid;
 
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
+    while ((opt = getopt(argc, argv, "euLa:p:t:q:r:Cz:ki:c:d:w:l:v")) != -1) {
+        switch (opt) {
+        case 'e':
+            /* epoll event loop instead of a thread per connection */
+            event_mode = 1;
+            break;
+        case 'u':
+            /* io_uring engine */
+            uring_mode = 1;
+            break;
+        case 'r':
+            /* SO_REUSEPORT reactors, 0 for one per cpu */
+            reactors = atoi(optarg);
+            break;
+        case 'C':
+            /* pin reactors to cpus */
+            pin = 1;
+            break;
+        case 'z':
+            /* origin to client relay */
+            if (!strcasecmp(optarg, "copy")) {
+                relay_mode = RELAY_COPY;
+            } else if (!strcasecmp(optarg, "splice")) {
+                relay_mode = RELAY_SPLICE;
+            } else if (!strcasecmp(optarg, "tee")) {
+                relay_mode = RELAY_TEE;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'k':
+            /* persistent HTTP/1.1 connections to origins */
+            upstream_keepalive = 1;
+            break;
+        case 'i':
+            /* client idle timeout, 0 disables persistent connections */
+            if ((client_idle_timeout = atoi(optarg)) < 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'c':
+            /* origin connect timeout */
+            if ((connect_timeout = atol(optarg)) < 1) {
+                usage(argv[0]);
+            }
+            break;
+        case 'd':
+            /* deadline of an origin's response head */
+            if ((request_timeout = atol(optarg)) < 1) {
+                usage(argv[0]);
+            }
+            break;
+        case 'w':
+            /* wait for each read of a response body */
+            if ((read_timeout = atol(optarg)) < 1) {
+                usage(argv[0]);
+            }
+            break;
+        case 'l':
+            /* log file instead of stdout */
+            if ((log_fd = open(optarg, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+                fprintf(stderr, "%s: %s\n", optarg, strerror(errno));
+                exit(1);
+            }
+            break;
+        case 'v':
+            /* debug messages too */
+            level = LOG_DEBUG;
+            break;
+        case 'L':
+            /* lock-free cache reads */
+            cache_lockfree = 1;
+            break;
+        case 'a':
+            /* admission policy */
+            if (!strcasecmp(optarg, "all")) {
+                cache_admission = ADMIT_ALL;
+            } else if (!strcasecmp(optarg, "tinylfu")) {
+                cache_admission = ADMIT_TINYLFU;
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'p':
+            /* eviction policy */
+            if ((cache_policy = find_policy(optarg)) == NULL) {
+                usage(argv[0]);
+            }
+            break;
+        case 't':
+            /* worker threads */
+            if ((nthreads = atoi(optarg)) < 1) {
+                usage(argv[0]);
+            }
+            break;
+        case 'q':
+            /* connection queue depth */
+            if ((sbufsize = atoi(optarg)) < 1) {
+                usage(argv[0]);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
     }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+
+    /* blocked before any thread starts, so only stop takes them */
+    Sigemptyset(&stop_signals);
+    Sigaddset(&stop_signals, SIGINT);
+    Sigaddset(&stop_signals, SIGTERM);
+    Sigprocmask(SIG_BLOCK, &stop_signals, NULL);
+    Pthread_create(&tid, NULL, stop, &stop_signals);
 
+    init_log(log_fd, level);
     init_cache();
+    init_flight();
+    init_upstream();
+    init_dns();
+    init_http();
 
-    listenfd = Open_listenfd(argv[1]);
+    if (reactors >= 0) {
+        run_reactors(argv[optind], reactors, pin);
+    }
+
+    listenfd = Open_listenfd(argv[optind]);
+
+    if (uring_mode && run_uring(listenfd) < 0) {
+        log_msg(LOG_WARN, "io_uring unavailable, using worker threads");
+    }
+    if (event_mode) {
+        run_reactor(create_reactor(listenfd));
+    }
+
+    accepted_max = sysconf(_SC_OPEN_MAX);
+    accepted_at = (long *)Calloc(accepted_max, sizeof(long));
+    sbuf_init(&sbuf, sbufsize);
+    init_parking();
+    for (i = 0; i < nthreads; i++) {
+        Pthread_create(&tid, NULL, worker, NULL);
+    }
 
     while (1) {
         clientlen = sizeof(clientaddr);
-        fd_client = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        Getnameinfo((SA *) &clientaddr, clientlen, hostname,
-                MAXLINE, port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
-        pthread_t tid;
-        Pthread_create(&tid, NULL, handle_client_request, (void *)&fd_client);
-        Pthread_detach(tid);
+        if ((fd_client = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
+            /* aborted connections and descriptor exhaustion pass */
+            log_msg(LOG_WARN, "accept error: %s", strerror(errno));
+            if (errno == EMFILE || errno == ENFILE) {
+                usleep(10000);
+            }
+            continue;
+        }
+        if (log_level <= LOG_DEBUG) {
+            if (getnameinfo((SA *) &clientaddr, clientlen, hostname,
+                            MAXLINE, port, MAXLINE, 0) != 0) {
+                strcpy(hostname, "?");
+                strcpy(port, "?");
+            }
+            log_msg(LOG_DEBUG, "accepted connection from (%s, %s)", hostname, port);
+        }
+        if (fd_client >= accepted_max) {
+            /* beyond what the parking and timing arrays cover */
+            close(fd_client);
+            continue;
+        }
+        accepted_at[fd_client] = now_us();
+        __atomic_fetch_add(&stats.active_connections, 1, __ATOMIC_RELAXED);
+        sbuf_insert(&sbuf, fd_client);
     }
 }
 
 /*
- * handle_client_request - handles http request from client
+ * usage - prints the command line options and exits
  */
-void *handle_client_request(void *arg) {
-    int fd_client = *((int *)arg);
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
-    char host[MAXLINE], port[MAXLINE], query[MAXLINE];
-    char request[MAXBUF], response[MAX_OBJECT_SIZE];
+void usage(char *prog) {
+    fprintf(stderr, "usage: %s [options] <port>\n", prog);
+    fprintf(stderr, "  -e            epoll event loop instead of a thread per connection\n");
+    fprintf(stderr, "  -u            io_uring engine, worker threads if the kernel lacks it\n");
+    fprintf(stderr, "  -r <n>        n event loops on SO_REUSEPORT sockets, 0 for one per cpu\n");
+    fprintf(stderr, "  -C            pin the -r event loops to cpus\n");
+    fprintf(stderr, "  -t <n>        worker threads (default %d)\n", NTHREADS);
+    fprintf(stderr, "  -q <n>        connections queued for the workers (default %d)\n", SBUFSIZE);
+    fprintf(stderr, "  -z <relay>    worker relay: copy (default), splice or tee\n");
+    fprintf(stderr, "  -k            keep origin connections open for reuse (HTTP/1.1)\n");
+    fprintf(stderr, "  -i <secs>     idle timeout of persistent clients, 0 to close (default %d)\n",
+            CLIENT_IDLE_TIMEOUT);
+    fprintf(stderr, "  -c <ms>       origin connect timeout (default %d)\n", CONNECT_TIMEOUT);
+    fprintf(stderr, "  -d <ms>       deadline of an origin's response head (default %d)\n",
+            REQUEST_TIMEOUT);
+    fprintf(stderr, "  -w <ms>       wait for each read of a response body (default %d)\n",
+            READ_TIMEOUT);
+    fprintf(stderr, "  -L            lock-free cache reads, hits applied in batches\n");
+    fprintf(stderr, "  -a <policy>   cache admission: all (default) or tinylfu\n");
+    fprintf(stderr, "  -p <policy>   cache eviction: lfulru (default), arc, s3fifo or gdsf\n");
+    fprintf(stderr, "  -l <file>     append the log to file instead of stdout\n");
+    fprintf(stderr, "  -v            log debug messages too\n");
+    exit(1);
+}
+
+/*
+ * stop - waits for SIGINT or SIGTERM and exits through the atexit flush
+ * of the log, from a thread of its own since exit is not safe in a
+ * signal handler
+ */
+void *stop(void *arg) {
+    int sig;
+
+    while (sigwait((sigset_t *)arg, &sig) != 0) {
+    }
+    exit(0);
+}
+
+/*
+ * worker - serves connections from the queue forever
+ */
+void *worker(void *arg) {
+    Pthread_detach(pthread_self());
+    while (1) {
+        handle_client_request(sbuf_remove(&sbuf));
+        if (cache_lockfree) {
+            /* buffered hits must not keep their nodes pinned while the worker waits */
+            drain_access();
+        }
+    }
+    return NULL;
+}
+
+/*
+ * init_parking - starts the thread that watches idle persistent connections
+ */
+void init_parking() {
+    pthread_t tid;
+
+    if ((park_epfd = epoll_create1(0)) < 0) {
+        unix_error("epoll_create1 error");
+    }
+    idle_until = (long *)Calloc(accepted_max, sizeof(long));
+    Pthread_create(&tid, NULL, idle_watcher, NULL);
+}
+
+/* doubles the ring of parked deadlines, park_mutex must be held */
+static void grow_parked() {
+    int size = parked_size ? 2 * parked_size : 64, i;
+    Parked_t *bigger = (Parked_t *)Malloc(size * sizeof(Parked_t));
+
+    for (i = 0; i < parked_len; i++) {
+        bigger[i] = parked[(parked_head + i) % parked_size];
+    }
+    Free(parked);
+    parked = bigger;
+    parked_head = 0;
+    parked_size = size;
+}
+
+/*
+ * park_connection - hands a persistent connection with no request waiting
+ * to the idle watcher, which queues it again once it is readable or
+ * closes it after client_idle_timeout
+ */
+void park_connection(int fd_client) {
+    struct epoll_event ev;
+    long until = now_ms() + client_idle_timeout * 1000L;
+    Parked_t *p;
+
+    pthread_mutex_lock(&park_mutex);
+    if (parked_len == parked_size) {
+        grow_parked();
+    }
+    p = &parked[(parked_head + parked_len++) % parked_size];
+    p->fd = fd_client;
+    p->until = until;
+    idle_until[fd_client] = until;
+    pthread_mutex_unlock(&park_mutex);
+
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.fd = fd_client;
+    epoll_ctl(park_epfd, EPOLL_CTL_ADD, fd_client, &ev);
+}
+
+/* closes a client connection for good */
+static void close_client(int fd_client) {
+    close(fd_client);
+    __atomic_fetch_sub(&stats.active_connections, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * idle_watcher - queues parked connections for a worker as their next
+ * request arrives, and closes those idle too long. The worker queue may
+ * be full, so connections with a request are handed on without waiting:
+ * those it has no room for are kept and tried again every
+ * HANDOFF_RETRY milliseconds, while the idle ones keep timing out
+ */
+void *idle_watcher(void *arg) {
+    struct epoll_event events[EVENT_MAX];
+    Parked_t *p;
+    long now;
+    int n, i, j, fd, ready, nwaiting = 0;
+    int *waiting = (int *)Malloc(accepted_max * sizeof(int));
+
+    Pthread_detach(pthread_self());
+    while (1) {
+        n = epoll_wait(park_epfd, events, EVENT_MAX, nwaiting > 0 ? HANDOFF_RETRY : 1000);
+        if (n < 0 && errno != EINTR) {
+            unix_error("epoll_wait error");
+        }
+        for (i = 0; i < n; i++) {
+            fd = events[i].data.fd;
+            epoll_ctl(park_epfd, EPOLL_CTL_DEL, fd, NULL);
+            pthread_mutex_lock(&park_mutex);
+            ready = idle_until[fd] != 0;
+            idle_until[fd] = 0;
+            pthread_mutex_unlock(&park_mutex);
+            if (ready) {
+                waiting[nwaiting++] = fd;
+            }
+        }
+        /* in the order they became ready, as far as the queue has room */
+        for (i = 0, j = 0; i < nwaiting; i++) {
+            if (j > 0 || sbuf_try_insert(&sbuf, waiting[i]) < 0) {
+                waiting[j++] = waiting[i];
+            }
+        }
+        nwaiting = j;
+
+        now = now_ms();
+        pthread_mutex_lock(&park_mutex);
+        while (parked_len > 0 && (p = &parked[parked_head])->until <= now) {
+            if (idle_until[p->fd] == p->until) {
+                /* still parked since this deadline was set */
+                idle_until[p->fd] = 0;
+                epoll_ctl(park_epfd, EPOLL_CTL_DEL, p->fd, NULL);
+                close_client(p->fd);
+            }
+            parked_head = (parked_head + 1) % parked_size;
+            parked_len--;
+        }
+        pthread_mutex_unlock(&park_mutex);
+    }
+    return NULL;
+}
+
+/*
+ * handle_client_request - handles http requests from client, several of
+ * them in order on a persistent connection. Once no request is waiting
+ * the connection is parked rather than holding the worker while it idles
+ */
+void handle_client_request(int fd_client) {
+    struct timeval timeout;
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    char client[INET6_ADDRSTRLEN] = "?";
+    long accepted = accepted_at[fd_client];
     rio_t rio;
-    int fd_server;
+
+    /* only the first request waited on the accept */
+    accepted_at[fd_client] = 0;
+    if (accepted != 0 && client_idle_timeout > 0) {
+        /* bounds reading the rest of a head that started to arrive */
+        timeout.tv_sec = client_idle_timeout;
+        timeout.tv_usec = 0;
+        setsockopt(fd_client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    /* numeric, for the access log */
+    if (getpeername(fd_client, (SA *)&addr, &addrlen) == 0) {
+        getnameinfo((SA *)&addr, addrlen, client, sizeof(client), NULL, 0,
+                    NI_NUMERICHOST);
+    }
+
+    rio_readinitb(&rio, fd_client);
+    while (serve_request(fd_client, &rio, client, accepted)) {
+        accepted = 0;
+        if (rio.rio_cnt == 0) {
+            /* nothing pipelined, the next request may be a while */
+            park_connection(fd_client);
+            return;
+        }
+    }
+    close_client(fd_client);
+}
+
+/*
+ * read_head - reads lines up to the empty line ending a head into head,
+ * skipping empty lines before it. If deadline is set it is armed on
+ * the socket whenever the rio buffer runs dry. Returns the head length
+ * or -1 if it does not fit in MAXBUF or the connection went away
+ */
+static ssize_t read_head(rio_t *rio, char *head, Deadline_t *deadline) {
+    char *line;
+    size_t len = 0;
+    ssize_t n;
+
+    /* Lines are taken as slices of the rio buffer and copied only once */
+    while ((deadline == NULL || rio->rio_cnt > 0 || deadline_arm(deadline) == 0) &&
+           (n = rio_readlinep(rio, &line)) > 0) {
+        if (len + n >= MAXBUF) {
+            return -1;
+        }
+        if (line[0] == '\n' || (n == 2 && line[0] == '\r')) {
+            if (len == 0) {
+                continue;
+            }
+            memcpy(head + len, line, n);
+            return len + n;
+        }
+        memcpy(head + len, line, n);
+        len += n;
+    }
+    return -1;
+}
+
+/*
+ * request_keepalive - returns whether the client wants the connection
+ * kept open, given the default of its HTTP version
+ */
+static int request_keepalive(Http_request_t *req, int keepalive) {
+    Http_header_t *h;
+    int i;
+
+    for (i = 0; i < req->nheaders; i++) {
+        h = &req->headers[i];
+        if (http_slice_is(&h->name, "Connection") ||
+            http_slice_is(&h->name, "Proxy-Connection")) {
+            if (http_has_token(&h->value, "close")) {
+                keepalive = 0;
+            } else if (http_has_token(&h->value, "keep-alive")) {
+                keepalive = 1;
+            }
+        }
+    }
+    return keepalive;
+}
+
+/*
+ * response_body - returns how the body of a parsed response is framed,
+ * setting *length for BODY_LENGTH
+ */
+static int response_body(Http_response_t *resp, ssize_t *length) {
+    Http_slice_t *value;
+
+    if ((resp->status >= 100 && resp->status < 200) || resp->status == 204 ||
+        resp->status == 304) {
+        return BODY_NONE;
+    }
+    value = http_find_header(resp->headers, resp->nheaders, "Transfer-Encoding");
+    if (value != NULL && http_has_token(value, "chunked")) {
+        return BODY_CHUNKED;
+    }
+    if ((value = http_find_header(resp->headers, resp->nheaders, "Content-Length")) != NULL) {
+        if ((*length = strtol(value->p, NULL, 10)) >= 0) {
+            return BODY_LENGTH;
+        }
+    }
+    return BODY_CLOSE;
+}
+
+/* returns 1 if a response header only applies to the connection it came on */
+static int hop_header(Http_header_t *h, Http_slice_t *connection) {
+    char name[MAXLINE];
+    int i;
+
+    for (i = 0; hop_headers[i] != NULL; i++) {
+        if (http_slice_is(&h->name, hop_headers[i])) {
+            return 1;
+        }
+    }
+    return connection != NULL && http_copy(name, MAXLINE, &h->name) == 0 &&
+           http_has_token(connection, name);
+}
+
+/*
+ * append_head - appends a parsed response head to out as the proxy sends
+ * it on: our own HTTP version, no hop-by-hop headers and no empty line
+ * yet. length is FRAMING_KEEP, FRAMING_CLOSE or the Content-Length of a
+ * body that replaces the framing the origin chose
+ */
+static void append_head(Buf_t *out, Http_response_t *resp, ssize_t length) {
+    Http_slice_t *connection;
+    Http_header_t *h;
+    int i;
+
+    connection = http_find_header(resp->headers, resp->nheaders, "Connection");
+    buf_printf(out, "HTTP/1.1 %d ", resp->status);
+    buf_append(out, resp->reason.p, resp->reason.len);
+    buf_puts(out, "\r\n");
+    for (i = 0; i < resp->nheaders; i++) {
+        h = &resp->headers[i];
+        if (hop_header(h, connection) ||
+            (length != FRAMING_KEEP && (http_slice_is(&h->name, "Content-Length") ||
+                                        http_slice_is(&h->name, "Transfer-Encoding")))) {
+            continue;
+        }
+        buf_append(out, h->name.p, h->name.len);
+        buf_puts(out, ": ");
+        buf_append(out, h->value.p, h->value.len);
+        buf_puts(out, "\r\n");
+    }
+    if (length >= 0) {
+        buf_printf(out, "Content-Length: %zd\r\n", length);
+    }
+}
+
+/*
+ * format_reply - appends the head the client gets for a parsed response
+ * to out, with a Connection header of our own. The connection is kept
+ * only if the client wants it and can tell where the body ends; an
+ * HTTP/1.0 client gets a chunked body de-chunked and the connection closed
+ */
+static void format_reply(Reply_t *reply, Buf_t *out, Http_response_t *resp) {
+    ssize_t length;
+    int body = response_body(resp, &length);
+
+    reply->status = resp->status;
+    reply->dechunking = (body == BODY_CHUNKED && reply->minor_version == 0);
+    if (reply->dechunking) {
+        http_dechunk_init(&reply->dechunk);
+    }
+    if (body == BODY_CLOSE || reply->dechunking) {
+        reply->keepalive = 0;
+    }
+    append_head(out, resp, reply->dechunking ? FRAMING_CLOSE : FRAMING_KEEP);
+    buf_printf(out, "Connection: %s\r\n\r\n", reply->keepalive ? "keep-alive" : "close");
+}
+
+/*
+ * send_reply - sends the head, if there is one, and n bytes of body to
+ * the client, de-chunking the body in place if the client needs it
+ */
+static int send_reply(Reply_t *reply, Buf_t *head, char *body, size_t n) {
+    struct iovec iov[2];
+    int cnt = 0;
+    ssize_t sent;
+
+    if (reply->dechunking) {
+        n = http_dechunk(&reply->dechunk, body, n);
+    }
+    if (head != NULL) {
+        reply->first_byte = now_us();
+        buf_iov(head, 0, &iov[cnt++]);
+    }
+    if (n > 0) {
+        iov[cnt].iov_base = body;
+        iov[cnt++].iov_len = n;
+    }
+    if (cnt > 0) {
+        if ((sent = buf_writev(reply->fd, iov, cnt)) < 0) {
+            return -1;
+        }
+        reply->sent += sent;
+    }
+    return 0;
+}
+
+/*
+ * store_response - appends a complete response as the cache keeps it to
+ * out: framed by a Content-Length, so that any client can keep its
+ * connection after a hit. Returns -1 if it does not parse
+ */
+static int store_response(Buf_t *out, char *response, size_t size) {
+    Http_response_t resp;
+    Http_dechunk_t dechunk;
+    char *body, *copy = NULL;
+    ssize_t length;
+    size_t n;
+    int len, framing;
+
+    if ((len = http_parse_response(response, size, &resp)) < 0) {
+        return -1;
+    }
+    body = response + len;
+    n = size - len;
+    framing = response_body(&resp, &length);
+    if (framing == BODY_CHUNKED) {
+        copy = Malloc(n);
+        memcpy(copy, body, n);
+        http_dechunk_init(&dechunk);
+        n = http_dechunk(&dechunk, copy, n);
+        body = copy;
+    }
+    append_head(out, &resp, framing == BODY_NONE ? FRAMING_KEEP : (ssize_t)n);
+    buf_puts(out, "\r\n");
+    buf_append(out, body, n);
+    Free(copy);
+    return 0;
+}
+
+/*
+ * serve_request - handles one http request from client, returns 1 if the
+ * connection stays open for the next one. Each request gets a line in
+ * the access log and its times in the histograms, the first byte timed
+ * from accepted if it is set and from the request head otherwise
+ */
+int serve_request(int fd_client, rio_t *rio, char *client, long accepted) {
+    char head[MAXBUF], method[MAXLINE], uri[MAXLINE];
+    char host[MAXLINE], port[MAXLINE], query[MAXLINE];
+    Buf_t request, stored, reply_head;
     int response_size = 0;
+    int leader, len;
+    Http_request_t req;
+    Http_response_t resp;
+    Reply_t reply;
+    Node_t *node;
+    Flight_t *flight;
+    Flight_reader_t reader;
+    long start, end;
+    int source;
 
-    Rio_readinitb(&rio, fd_client);
-    if (!Rio_readlineb(&rio, buf, MAXLINE)) {
-        return NULL;
+    if ((len = read_head(rio, head, NULL)) < 0) {
+        return 0;
+    }
+    start = now_us();
+    stats_add(&stats.client_bytes_in, len);
+    if (http_parse_request(head, len, &req) < 0 ||
+        http_copy(method, MAXLINE, &req.method) < 0 ||
+        http_copy(uri, MAXLINE, &req.target) < 0) {
+        client_error(fd_client, "", "400", "Bad Request",
+                     "Web Proxy could not parse the request");
+        log_msg(LOG_INFO, "%s \"-\" 400 0 0ms error", client);
+        return 0;
     }
-    printf("Received HTTP request %s", buf);
-    sscanf(buf, "%s %s", method, uri);
     if (strcasecmp(method, "GET")) {
         /* Not a GET request */
         client_error(fd_client, method, "501", "Not Implemented",
                      "Web Proxy does not implement this method");
-        return NULL;
+        log_msg(LOG_INFO, "%s \"%s %s\" 501 0 0ms error", client, method, uri);
+        return 0;
     }
+    memset(&reply, 0, sizeof(reply));
+    reply.fd = fd_client;
+    reply.minor_version = req.minor_version;
+    reply.keepalive = client_idle_timeout > 0 &&
+                      request_keepalive(&req, req.minor_version >= 1);
 
-    response_size = get_cache(uri, response);
+    if (!strcmp(uri, STATS_PATH)) {
+        return serve_stats(fd_client, client, reply.keepalive);
+    }
+
+    node = get_cache(uri);
 
-    if (response_size) {
-        /* uri in cache */
-        Rio_writen(fd_client, response, response_size);
+    if (node) {
+        /* uri in cache, send it straight from the pinned node */
+        source = STATS_HIT;
+        buf_init(&reply_head);
+        /* stored responses have a Content-Length, so the body is never de-chunked in place */
+        if ((len = http_parse_response(node->response, node->size, &resp)) < 0) {
+            reply.keepalive = 0;
+        } else {
+            format_reply(&reply, &reply_head, &resp);
+            if (send_reply(&reply, &reply_head, node->response + len, node->size - len) < 0) {
+                reply.keepalive = 0;
+            }
+        }
+        buf_free(&reply_head);
+        response_size = node->size;
 
-        Close(fd_client);
+        access_node(node);
+        release_node(node);
+    } else if ((flight = flight_join(uri, &reader, &leader)) && !leader) {
+        /* uri being fetched by another request, stream it from there */
+        source = STATS_SHARED;
+        relay_flight(flight, &reader, &reply);
 
-        access_node(uri);
+        flight_release(flight, &reader);
     } else {
-        /* uri not in cache */
+        /* uri not in cache, fetch it for us and any followers */
+        source = STATS_MISS;
         parse_uri(uri, host, port, query);
 
-        construct_request(request, method, query, "HTTP/1.0",
-                          user_agent_hdr, host, "close", "close", &rio);
+        buf_init(&request);
+        build_request(&request, &req, query, host, upstream_keepalive);
+        log_msg(LOG_DEBUG, "fetching %s from %s:%s", query, host, port);
 
-        fd_server = Open_clientfd(host, port);
+        response_size = fetch_response(&request, host, port, &reply, flight);
+        buf_free(&request);
 
-        printf("Sending request to server:\n%s\n", request);
+        if (response_size >= 0 && response_size < MAX_OBJECT_SIZE) {
+            buf_init(&stored);
+            if (store_response(&stored, flight->data, response_size) == 0 &&
+                (node = put_cache(uri, stored.data, stored.len)) != NULL) {
+                access_node(node);
+                release_node(node);
+            }
+            buf_free(&stored);
+        }
 
-        Rio_writen(fd_server, request, strlen(request));
+        /* the response is in the cache before new requests stop attaching */
+        flight_finish(flight, response_size >= 0);
+        flight_release(flight, NULL);
+    }
+
+    stats_request(source, accepted ? accepted : start, start, reply.first_byte, reply.sent);
+    end = now_us();
+
+    log_msg(LOG_INFO, "%s \"%s %s\" %d %zu %ldms %s", client, method, uri, reply.status,
+            reply.sent, (end - start) / 1000, stats_sources[source]);
+
+    return reply.keepalive && response_size >= 0;
+}
+
+/*
+ * serve_stats - answers the admin URL with the statistics, to loopback
+ * clients only; returns 1 if the connection stays open
+ */
+int serve_stats(int fd_client, char *client, int keepalive) {
+    Buf_t out;
+    int ok;
 
-        response_size = handle_server_response(fd_server, fd_client, response);
+    if (!stats_local(fd_client)) {
+        client_error(fd_client, STATS_PATH, "403", "Forbidden",
+                     "Web Proxy serves its statistics to local clients only");
+        log_msg(LOG_INFO, "%s \"GET %s\" 403 0 0ms error", client, STATS_PATH);
+        return 0;
+    }
+
+    buf_init(&out);
+    stats_response(&out, keepalive);
+    ok = rio_writen(fd_client, out.data, out.len) >= 0;
+    log_msg(LOG_INFO, "%s \"GET %s\" 200 %zu 0ms admin", client, STATS_PATH, out.len);
+    buf_free(&out);
+    return keepalive && ok;
+}
 
-        Close(fd_client);
+/*
+ * relay_flight - streams a response that another request is fetching,
+ * with a head for this client
+ */
+void relay_flight(Flight_t *flight, Flight_reader_t *reader, Reply_t *reply) {
+    char buf[MAXBUF];
+    Http_response_t resp;
+    Buf_t head;
+    ssize_t n;
+    int len;
 
-        if (response_size < MAX_OBJECT_SIZE) {
-            put_cache(uri, response, response_size);
-            access_node(uri);
+    /* the leader appends the head in one piece before any of the body */
+    if ((n = flight_read(flight, reader, buf, MAXBUF)) > 0) {
+        if ((len = http_parse_response(buf, n, &resp)) < 0) {
+            reply->keepalive = 0;
+            return;
+        }
+        buf_init(&head);
+        format_reply(reply, &head, &resp);
+        if (send_reply(reply, &head, buf + len, n - len) < 0) {
+            n = -1;
+        }
+        buf_free(&head);
+        while (n > 0 && (n = flight_read(flight, reader, buf, MAXBUF)) > 0) {
+            if (send_reply(reply, NULL, buf, n) < 0) {
+                n = -1;
+            }
         }
     }
+    if (n < 0 && reader->off == 0) {
+        /* the leader failed before any of the response came */
+        client_error(reply->fd, "", "502", "Bad Gateway",
+                     "Web Proxy could not get the response from the server");
+        reply->status = 502;
+    }
+    if (n < 0) {
+        reply->keepalive = 0;
+    }
+}
 
-    printf("Success");
+/*
+ * fetch_response - sends the request to the origin and relays the
+ * response, over a pooled connection with upstream keep-alive, retrying
+ * on a fresh connection if a reused one turns out closed. If the origin
+ * fails before answering, the client gets a 502, or a 504 when it timed
+ * out. Returns the size of the response as the flight has it or -1 on
+ * error
+ */
+int fetch_response(Buf_t *request, char *host, char *port, Reply_t *reply,
+        Flight_t *flight) {
+    int fd_server, reused = 0, reusable, size;
+    long deadline = now_ms() + request_timeout, start;
+    Deadline_t timeouts;
+    struct iovec iov;
 
-    return NULL;
+    while (1) {
+        start = now_us();
+        if (upstream_keepalive) {
+            fd_server = upstream_get(host, port, &reused, deadline);
+        } else {
+            fd_server = connect_host(host, port, deadline);
+        }
+        if (fd_server >= 0 && !reused) {
+            stats_observe(&stats.upstream_connect, now_us() - start);
+        }
+        if (fd_server < 0) {
+            if (errno == ETIMEDOUT) {
+                client_error(reply->fd, host, "504", "Gateway Timeout",
+                             "Web Proxy timed out connecting to the server");
+                reply->status = 504;
+            } else {
+                client_error(reply->fd, host, "502", "Bad Gateway",
+                             "Web Proxy could not connect to the server");
+                reply->status = 502;
+            }
+            return -1;
+        }
+        size = FETCH_CLOSED;
+        buf_iov(request, 0, &iov);
+        deadline_init(&timeouts, fd_server, deadline);
+        if (deadline_arm(&timeouts) == 0 && buf_writev(fd_server, &iov, 1) >= 0) {
+            stats_add(&stats.origin_bytes_out, request->len);
+            size = handle_server_response(fd_server, reply, flight, &reusable, &timeouts);
+        }
+        if (size == FETCH_CLOSED && reused) {
+            /* the origin closed the idle connection meanwhile */
+            close(fd_server);
+            continue;
+        }
+        if (size >= 0 && reusable && upstream_keepalive) {
+            upstream_put(host, port, fd_server);
+        } else {
+            close(fd_server);
+        }
+
+        if (size == FETCH_TIMEOUT || (size == FETCH_CLOSED && now_ms() >= deadline)) {
+            client_error(reply->fd, host, "504", "Gateway Timeout",
+                         "Web Proxy timed out waiting for the server");
+            reply->status = 504;
+        } else if (size == FETCH_CLOSED) {
+            client_error(reply->fd, host, "502", "Bad Gateway",
+                         "Web Proxy got no response from the server");
+            reply->status = 502;
+        }
+        return size < 0 ? -1 : size;
+    }
 }
 
 /*
- * handle_server_response - handles http response from server, returns response size
+ * forward_bytes - appends body bytes from the origin to the flight and
+ * sends them on to the client
  */
-int handle_server_response(int fd_server, int fd_client, char *response) {
-    printf("\n\nhandling server response\n\n");
-    rio_t rio;
+static int forward_bytes(Reply_t *reply, Flight_t *flight, char *buf, size_t n) {
+    /* first, since de-chunking for the client rewrites buf */
+    flight_append(flight, buf, n);
+    return send_reply(reply, NULL, buf, n);
+}
+
+/*
+ * relay_body - relays limit bytes of the response body, all of it if
+ * limit is -1, under deadline; returns the bytes relayed or -1 on error
+ * or truncation
+ */
+static ssize_t relay_body(rio_t *rio, Reply_t *reply, Flight_t *flight,
+        ssize_t limit, Deadline_t *deadline) {
     char buf[MAXBUF];
-    int cur_size = 0, total_size = 0;
+    ssize_t n, total = 0, want;
 
-    Rio_readinitb(&rio, fd_server);
+    /* bytes to de-chunk have to pass through user space */
+    if (relay_mode != RELAY_COPY && !reply->dechunking) {
+        /* bytes already buffered by rio first, the rest straight from the socket */
+        if ((total = rio->rio_cnt) > 0) {
+            if (limit >= 0 && total > limit) {
+                total = limit;
+            }
+            if (forward_bytes(reply, flight, rio->rio_bufptr, total) < 0) {
+                return -1;
+            }
+            rio->rio_bufptr += total;
+            rio->rio_cnt -= total;
+        }
+        if (limit >= 0 && total == limit) {
+            return total;
+        }
+        if (deadline_arm(deadline) < 0) {
+            return -1;
+        }
+        n = relay_response(rio->rio_fd, reply->fd, flight,
+                           limit < 0 ? -1 : limit - total);
+        if (n > 0) {
+            reply->sent += n;
+        }
+        if (n < 0 || (limit >= 0 && total + n < limit)) {
+            return -1;
+        }
+        return total + n;
+    }
 
-    while ((cur_size = Rio_readnb(&rio, buf, MAXBUF))) {
-        printf("%s", buf);
-        Rio_writen(fd_client, buf, cur_size);
-        if (total_size + cur_size < MAX_OBJECT_SIZE) {
-            memcpy(response + total_size, buf, cur_size);
+    while (limit < 0 || total < limit) {
+        want = (limit < 0 || limit - total > MAXBUF) ? MAXBUF : limit - total;
+        if (deadline_arm(deadline) < 0 ||
+            (n = rio_readnb(rio, buf, want)) < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            return limit < 0 ? total : -1;
         }
-        total_size += cur_size;
+        if (forward_bytes(reply, flight, buf, n) < 0) {
+            return -1;
+        }
+        total += n;
     }
+    return total;
+}
 
-    Close(fd_server);
+/*
+ * relay_chunked - relays a chunked response body under deadline, returns
+ * its size or -1
+ */
+static ssize_t relay_chunked(rio_t *rio, Reply_t *reply, Flight_t *flight,
+        Deadline_t *deadline) {
+    char buf[MAXLINE];
+    ssize_t n, total = 0;
+    long size;
+    int last;
+
+    do {
+        if (deadline_arm(deadline) < 0 ||
+            (n = rio_readlineb(rio, buf, MAXLINE)) <= 0) {
+            return -1;
+        }
+        /* parsed before forward_bytes can de-chunk the line away */
+        size = strtol(buf, NULL, 16);
+        if (forward_bytes(reply, flight, buf, n) < 0) {
+            return -1;
+        }
+        total += n;
+        if (size > 0) {
+            /* chunk data and its CRLF */
+            if ((n = relay_body(rio, reply, flight, size + 2, deadline)) < 0) {
+                return -1;
+            }
+            total += n;
+        }
+    } while (size > 0);
 
-    return total_size;
+    /* trailers up to the empty line */
+    do {
+        if (deadline_arm(deadline) < 0 ||
+            (n = rio_readlineb(rio, buf, MAXLINE)) <= 0) {
+            return -1;
+        }
+        last = !strcmp(buf, "\r\n") || !strcmp(buf, "\n");
+        if (forward_bytes(reply, flight, buf, n) < 0) {
+            return -1;
+        }
+        total += n;
+    } while (!last);
+    return total;
+}
+
+/*
+ * handle_server_response - handles http response from server. The flight
+ * of its uri gets it without hop-by-hop headers, the client with a head
+ * made for it by format_reply. The body is framed by Content-Length,
+ * chunked encoding or the end of the connection; *reusable is set if the
+ * connection can carry another request. The head has to arrive by
+ * deadline, after which each read may wait read_timeout for progress.
+ * Returns the size of the response in the flight, FETCH_FAILED once part
+ * of it reached the client, or FETCH_CLOSED or FETCH_TIMEOUT if the
+ * server did not answer at all
+ */
+int handle_server_response(int fd_server, Reply_t *reply, Flight_t *flight,
+        int *reusable, Deadline_t *deadline) {
+    long sent = now_us();
+    rio_t rio;
+    char head[MAXBUF];
+    int keepalive, body;
+    ssize_t n, total, length = -1;
+    Http_response_t resp;
+    Http_slice_t *value;
+    Buf_t stored, out;
+
+    *reusable = 0;
+    rio_readinitb(&rio, fd_server);
+
+    /* the head is taken whole, so nothing reached the client if it fails */
+    if ((total = read_head(&rio, head, deadline)) < 0 ||
+        http_parse_response(head, total, &resp) < 0) {
+        return (now_ms() >= deadline->at) ? FETCH_TIMEOUT : FETCH_CLOSED;
+    }
+    stats_observe(&stats.upstream_ttfb, now_us() - sent);
+    stats_add(&stats.origin_bytes_in, total);
+    deadline_idle(deadline, read_timeout);
+
+    buf_init(&stored);
+    append_head(&stored, &resp, FRAMING_KEEP);
+    buf_puts(&stored, "\r\n");
+    flight_append(flight, stored.data, stored.len);
+    buf_init(&out);
+    format_reply(reply, &out, &resp);
+    n = send_reply(reply, &out, NULL, 0);
+    buf_free(&out);
+    total = stored.len;
+    buf_free(&stored);
+    if (n < 0) {
+        return FETCH_FAILED;
+    }
+
+    keepalive = (resp.minor_version >= 1);
+    if ((value = http_find_header(resp.headers, resp.nheaders, "Connection")) != NULL) {
+        if (http_has_token(value, "close")) {
+            keepalive = 0;
+        } else if (http_has_token(value, "keep-alive")) {
+            keepalive = 1;
+        }
+    }
+
+    body = response_body(&resp, &length);
+    if (body == BODY_NONE) {
+        n = 0;
+    } else if (body == BODY_CHUNKED) {
+        n = relay_chunked(&rio, reply, flight, deadline);
+    } else if (body == BODY_LENGTH) {
+        n = relay_body(&rio, reply, flight, length, deadline);
+    } else {
+        /* delimited by the end of the connection */
+        keepalive = 0;
+        n = relay_body(&rio, reply, flight, -1, deadline);
+    }
+    if (n < 0) {
+        return FETCH_FAILED;
+    }
+    stats_add(&stats.origin_bytes_in, n);
+
+    /* nothing may follow the response on a connection that is reused */
+    *reusable = keepalive && rio.rio_cnt == 0;
+    return total + n;
 }
 
 /*
@@ -170,53 +1172,88 @@ void parse_uri(char *uri, char *host, char *port, char *query) {
         strcpy(port, pos_port);
     } else {
         strncpy(port, pos_port, pos_query - pos_port);
+        port[pos_query - pos_port] = '\0';
     }
 
     if (pos_port) {
         strncpy(host, pos_host, pos_port - pos_host - 1);
+        host[pos_port - pos_host - 1] = '\0';
     } else if (pos_query) {
         strncpy(host, pos_host, pos_query - pos_host);
+        host[pos_query - pos_host] = '\0';
     } else {
         strcpy(host, pos_host);
     }
+}
 
-    printf("host: %s\n", host);
-    printf("port: %s\n", port);
-    printf("query: %s\n", query);
-    printf("parse_uri success\n");
+/*
+ * replaced_header - checks whether a client header is one the proxy sets
+ * itself
+ */
+static int replaced_header(Http_header_t *h) {
+    int i;
+
+    for (i = 0; replaced_headers[i] != NULL; i++) {
+        if (http_slice_is(&h->name, replaced_headers[i])) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
 /*
- * construct_request - constructs an http request
+ * build_request - appends an http request for the origin, built from the
+ * client's parsed request head, to out in one pass
  */
-void construct_request(char *request, const char *method, const char *query,
-        const char *version, const char *user_agent, const char *host,
-        const char *connection, const char *proxy_connection, rio_t *rio) {
-    sprintf(request, "%s %s %s\r\n", method, query, version);
-    sprintf(request, "%sUser-Agent: %s", request, user_agent);
-    sprintf(request, "%sHost: %s\r\n", request, host);
-    sprintf(request, "%sConnection: %s\r\n", request, connection);
-    sprintf(request, "%sProxy-Connection: %s\r\n", request, proxy_connection);
+void build_request(Buf_t *out, Http_request_t *req, char *query, char *host,
+        int keepalive) {
+    char *connection = keepalive ? "keep-alive" : "close";
+    Http_header_t *h;
+    int i;
 
-    char buf[MAXLINE];
+    buf_printf(out, "%.*s %s %s\r\n", (int)req->method.len, req->method.p,
+               query, keepalive ? "HTTP/1.1" : "HTTP/1.0");
+    buf_puts(out, user_agent_hdr);
+    buf_printf(out, "Host: %s\r\n", host);
+    buf_printf(out, "Connection: %s\r\n", connection);
+    buf_printf(out, "Proxy-Connection: %s\r\n", connection);
 
-    if (!Rio_readlineb(rio, buf, MAXLINE)) {
-        sprintf(request, "%s\r\n", request);
-        return;
-    }
-    while (strcmp(buf, "\r\n")) {
-        if (!memcmp(buf, user_agent_name, strlen(user_agent_name)) ||
-            !memcmp(buf, host_name, strlen(host_name)) ||
-            !memcmp(buf, connection_name, strlen(connection_name)) ||
-            !memcmp(buf, proxy_connection_name, strlen(proxy_connection_name))) {
-            Rio_readlineb(rio, buf, MAXLINE);
-            continue;
+    for (i = 0; i < req->nheaders; i++) {
+        h = &req->headers[i];
+        if (!replaced_header(h)) {
+            buf_append(out, h->name.p, h->name.len);
+            buf_append(out, ": ", 2);
+            buf_append(out, h->value.p, h->value.len);
+            buf_append(out, "\r\n", 2);
         }
-        printf("%s", buf);
-        sprintf(request, "%s%s", request, buf);
-        Rio_readlineb(rio, buf, MAXLINE);
     }
-    sprintf(request, "%s\r\n", request);
+    buf_append(out, "\r\n", 2);
+}
+
+/*
+ * format_error - appends an error response for the client to out
+ */
+void format_error(Buf_t *out, char *cause, char *errnum,
+        char *shortmsg, char *longmsg) {
+    char body[MAXBUF];
+    int len;
+
+    /* Build the HTTP response body */
+    len = snprintf(body, sizeof(body),
+                   "<html><title>Tiny Error</title>"
+                   "<body bgcolor=""ffffff"">\r\n"
+                   "%s: %s\r\n"
+                   "<p>%s: %s\r\n"
+                   "<hr><em>The Web Proxy</em>\r\n",
+                   errnum, shortmsg, longmsg, cause);
+    if (len >= (int)sizeof(body)) {
+        len = sizeof(body) - 1;
+    }
+
+    /* Build the HTTP response */
+    buf_printf(out, "HTTP/1.0 %s %s\r\nContent-type: text/html\r\n"
+               "Content-length: %d\r\n\r\n", errnum, shortmsg, len);
+    buf_append(out, body, len);
 }
 
 /*
@@ -224,23 +1261,16 @@ void construct_request(char *request, const char *method, const char *query,
  */
 void client_error(int fd, char *cause, char *errnum,
         char *shortmsg, char *longmsg) {
-    char buf[MAXLINE], body[MAXBUF];
+    struct iovec iov;
+    Buf_t buf;
 
-    /* Build the HTTP response body */
-    sprintf(body, "<html><title>Tiny Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Web Proxy</em>\r\n", body);
-
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    Rio_writen(fd, buf, strlen(buf));
-    Rio_writen(fd, body, strlen(body));
+    buf_init(&buf);
+    format_error(&buf, cause, errnum, shortmsg, longmsg);
+
+    /* the client may be gone, which is not the proxy's problem */
+    buf_iov(&buf, 0, &iov);
+    buf_writev(fd, &iov, 1);
+    buf_free(&buf);
 }
 
 /* $end proxy.c */
@@ -0,0 +1,34 @@
+/*
+ * proxy.h - request helpers of the web proxy shared by its connection
+ * engines, prototypes.
+ */
+/* $begin proxy.h */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include "http.h"
+#include "buf.h"
+
+#define CLIENT_IDLE_TIMEOUT 5  /* default seconds a persistent client may idle */
+
+/* seconds a persistent client may idle, 0 closes after each response */
+extern int client_idle_timeout;
+
+/* parses an uri to host, port and query */
+void parse_uri(char *uri, char *host, char *port, char *query);
+
+/*
+ * appends an http request for the origin, built from the client's parsed
+ * request head, to out; HTTP/1.1 keep-alive if keepalive is set and
+ * HTTP/1.0 close otherwise
+ */
+void build_request(Buf_t *out, Http_request_t *req, char *query, char *host,
+        int keepalive);
+
+/* appends an error response for the client to out */
+void format_error(Buf_t *out, char *cause, char *errnum,
+        char *shortmsg, char *longmsg);
+
+#endif /* __PROXY_H__ */
+/* $end proxy.h */
@@ -0,0 +1,189 @@
+/*
+ * relay.c - origin to client relay of the threaded proxy.
+ *
+ * While the flight buffers the response, for the cache or for followers,
+ * the bytes have to reach user space. In RELAY_COPY mode they are read
+ * into a buffer and written to the client; in RELAY_TEE mode they are
+ * spliced into a pipe, duplicated with tee, spliced on to the client and
+ * only the duplicate is read, saving the copy back out. Once the flight
+ * stops buffering, both splice modes move the rest of the response from
+ * socket to socket through a pipe without it ever entering user space.
+ * Each worker thread makes its pipes on its first relay and keeps them,
+ * empty, for the next, chunks of a chunked body included.
+ */
+/* $begin relay.c */
+#define _GNU_SOURCE  /* splice and tee */
+#include "relay.h"
+
+int relay_mode = RELAY_COPY;
+
+/* the pipes of a worker thread */
+typedef struct Pipes {
+    int splice[2];  /* socket to socket */
+    int tee[2];     /* the duplicate for the flight, -1 unless RELAY_TEE */
+} Pipes_t;
+
+static pthread_key_t pipes_key;
+static pthread_once_t pipes_once = PTHREAD_ONCE_INIT;
+
+/* closes and frees a thread's pipes, also when the thread exits */
+static void free_pipes(void *arg) {
+    Pipes_t *pipes = arg;
+
+    close(pipes->splice[0]);
+    close(pipes->splice[1]);
+    if (pipes->tee[0] >= 0) {
+        close(pipes->tee[0]);
+        close(pipes->tee[1]);
+    }
+    Free(pipes);
+}
+
+static void init_pipes_key() {
+    pthread_key_create(&pipes_key, free_pipes);
+}
+
+/*
+ * returns the pipes of the calling thread, making them on its first
+ * relay; NULL if they cannot be made, to be tried again next time
+ */
+static Pipes_t *get_pipes() {
+    Pipes_t *pipes;
+
+    pthread_once(&pipes_once, init_pipes_key);
+    if ((pipes = pthread_getspecific(pipes_key)) != NULL) {
+        return pipes;
+    }
+    pipes = Malloc(sizeof(Pipes_t));
+    pipes->tee[0] = pipes->tee[1] = -1;
+    if (pipe(pipes->splice) < 0) {
+        Free(pipes);
+        return NULL;
+    }
+    if (relay_mode == RELAY_TEE && pipe(pipes->tee) < 0) {
+        close(pipes->splice[0]);
+        close(pipes->splice[1]);
+        Free(pipes);
+        return NULL;
+    }
+    pthread_setspecific(pipes_key, pipes);
+    return pipes;
+}
+
+/* drops the pipes of the calling thread, which an error may have left bytes in */
+static void drop_pipes(Pipes_t *pipes) {
+    pthread_setspecific(pipes_key, NULL);
+    free_pipes(pipes);
+}
+
+/* moves up to len bytes from fd_in to fd_out, one of them a pipe */
+static ssize_t splice_fd(int fd_in, int fd_out, size_t len) {
+    ssize_t n;
+
+    do {
+        n = splice(fd_in, NULL, fd_out, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+/* moves exactly len bytes from pipe fd_in to fd_out, returns -1 on error */
+static int splice_all(int fd_in, int fd_out, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = splice_fd(fd_in, fd_out, len)) <= 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+/* writes exactly len bytes, returns -1 on error */
+static int write_all(int fd, char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, buf, len)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* reads exactly len bytes from pipe fd into the flight, returns -1 on error */
+static int drain_pipe(int fd, size_t len, Flight_t *flight, int *buffering) {
+    char buf[MAXBUF];
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = read(fd, buf, len < MAXBUF ? len : MAXBUF)) <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        *buffering = flight_append(flight, buf, n);
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * relays up to limit bytes of the response, all of it if limit is -1,
+ * from fd_server to fd_client, feeding the flight for as long as it
+ * buffers; returns the bytes relayed or -1 on error
+ */
+ssize_t relay_response(int fd_server, int fd_client, Flight_t *flight,
+        ssize_t limit) {
+    char buf[MAXBUF];
+    Pipes_t *pipes = (relay_mode != RELAY_COPY) ? get_pipes() : NULL;
+    int buffering = 1;
+    ssize_t n = 0, total = 0, want;
+
+    while (limit < 0 || total < limit) {
+        want = (limit < 0 || limit - total > PIPE_CHUNK) ? PIPE_CHUNK : limit - total;
+        if (pipes != NULL && (!buffering || pipes->tee[0] >= 0)) {
+            if ((n = splice_fd(fd_server, pipes->splice[1], want)) <= 0) {
+                break;
+            }
+            /* the tee pipe is empty, so it takes the whole chunk */
+            if (buffering && tee(pipes->splice[0], pipes->tee[1], n, 0) != n) {
+                n = -1;
+                break;
+            }
+            if (splice_all(pipes->splice[0], fd_client, n) < 0 ||
+                (buffering && drain_pipe(pipes->tee[0], n, flight, &buffering) < 0)) {
+                n = -1;
+                break;
+            }
+        } else {
+            if ((n = read(fd_server, buf, want < MAXBUF ? want : MAXBUF)) <= 0) {
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            if (write_all(fd_client, buf, n) < 0) {
+                n = -1;
+                break;
+            }
+            if (buffering) {
+                buffering = flight_append(flight, buf, n);
+            }
+        }
+        total += n;
+    }
+
+    if (n < 0 && pipes != NULL) {
+        drop_pipes(pipes);
+    }
+    return n < 0 ? -1 : total;
+}
+
+/* $end relay.c */
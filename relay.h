@@ -0,0 +1,38 @@
+/*
+ * relay.h - origin to client relay of the threaded proxy, definition and
+ * prototypes.
+ */
+/* $begin relay.h */
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include "csapp.h"
+#include "flight.h"
+
+#define RELAY_COPY 0    /* read and write through user space */
+#define RELAY_SPLICE 1  /* splice once nothing needs the bytes in user space */
+#define RELAY_TEE 2     /* like RELAY_SPLICE, and tee the cacheable part */
+
+#define PIPE_CHUNK 65536  /* bytes moved per splice, the default pipe size */
+
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#endif
+#ifndef SPLICE_F_MORE
+#define SPLICE_F_MORE 4
+#endif
+
+extern int relay_mode;
+
+/* function prototypes */
+
+/*
+ * relays up to limit bytes of the response, all of it if limit is -1,
+ * from fd_server to fd_client, feeding the flight for as long as it
+ * buffers; returns the bytes relayed or -1 on error
+ */
+ssize_t relay_response(int fd_server, int fd_client, Flight_t *flight,
+        ssize_t limit);
+
+#endif /* __RELAY_H__ */
+/* $end relay.h */
@@ -0,0 +1,56 @@
+/*
+ * sbuf.c - bounded producer/consumer queue of descriptors, used to hand
+ * accepted connections to the worker threads.
+ */
+/* $begin sbuf.c */
+#include "sbuf.h"
+
+/* creates an empty, bounded, shared FIFO buffer with n slots */
+void sbuf_init(sbuf_t *sp, int n) {
+    sp->buf = (int *)Calloc(n, sizeof(int));
+    sp->n = n;
+    sp->front = sp->rear = 0;
+    Sem_init(&sp->mutex, 0, 1);
+    Sem_init(&sp->slots, 0, n);
+    Sem_init(&sp->items, 0, 0);
+}
+
+/* cleans up buffer sp */
+void sbuf_deinit(sbuf_t *sp) {
+    Free(sp->buf);
+}
+
+/* inserts item onto the rear of shared buffer sp, waiting for a free slot */
+void sbuf_insert(sbuf_t *sp, int item) {
+    P(&sp->slots);
+    P(&sp->mutex);
+    sp->buf[(++sp->rear) % (sp->n)] = item;
+    V(&sp->mutex);
+    V(&sp->items);
+}
+
+/* inserts item like sbuf_insert if a slot is free, returns -1 if not */
+int sbuf_try_insert(sbuf_t *sp, int item) {
+    if (sem_trywait(&sp->slots) < 0) {
+        return -1;
+    }
+    P(&sp->mutex);
+    sp->buf[(++sp->rear) % (sp->n)] = item;
+    V(&sp->mutex);
+    V(&sp->items);
+    return 0;
+}
+
+/* removes and returns the first item from buffer sp, waiting for one */
+int sbuf_remove(sbuf_t *sp) {
+    int item;
+
+    P(&sp->items);
+    P(&sp->mutex);
+    item = sp->buf[(++sp->front) % (sp->n)];
+    V(&sp->mutex);
+    V(&sp->slots);
+    return item;
+}
+
+/* $end sbuf.c */
@@ -0,0 +1,39 @@
+/*
+ * sbuf.h - bounded producer/consumer queue of descriptors, definition
+ * and prototypes.
+ */
+/* $begin sbuf.h */
+#ifndef __SBUF_H__
+#define __SBUF_H__
+
+#include "csapp.h"
+
+typedef struct {
+    int *buf;     /* buffer array */
+    int n;        /* maximum number of slots */
+    int front;    /* buf[(front+1)%n] is first item */
+    int rear;     /* buf[rear%n] is last item */
+    sem_t mutex;  /* protects accesses to buf */
+    sem_t slots;  /* counts available slots */
+    sem_t items;  /* counts available items */
+} sbuf_t;
+
+/* function prototypes */
+
+/* creates an empty, bounded, shared FIFO buffer with n slots */
+void sbuf_init(sbuf_t *sp, int n);
+
+/* cleans up buffer sp */
+void sbuf_deinit(sbuf_t *sp);
+
+/* inserts item onto the rear of shared buffer sp, waiting for a free slot */
+void sbuf_insert(sbuf_t *sp, int item);
+
+/* inserts item like sbuf_insert if a slot is free, returns -1 if not */
+int sbuf_try_insert(sbuf_t *sp, int item);
+
+/* removes and returns the first item from buffer sp, waiting for one */
+int sbuf_remove(sbuf_t *sp);
+
+#endif /* __SBUF_H__ */
+/* $end sbuf.h */
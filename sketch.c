@@ -0,0 +1,101 @@
+/*
+ * sketch.c - count-min sketch with a doorkeeper for TinyLFU admission.
+ */
+/* $begin sketch.c */
+#include "sketch.h"
+
+#define LONG_BITS (8 * sizeof(unsigned long))
+
+/* derives the i-th index hash from a key hash */
+static unsigned int rehash(unsigned int hash, int i) {
+    hash = hash * 0x9e3779b1u + (unsigned int)i * 0x85ebca6bu;
+    hash ^= hash >> 15;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 13;
+    return hash;
+}
+
+/* initializes a sketch with width counters per row */
+void sketch_init(Sketch_t *sketch, unsigned int width) {
+    sketch->width = width;
+    sketch->door_bits = width * 4;
+    sketch->table = (unsigned char *)Calloc(SKETCH_DEPTH, width);
+    sketch->door = (unsigned long *)Calloc(sketch->door_bits / LONG_BITS,
+                                           sizeof(unsigned long));
+    sketch->additions = 0;
+    sketch->sample_size = width * 10;
+}
+
+/* frees the counters of a sketch */
+void sketch_free(Sketch_t *sketch) {
+    Free(sketch->table);
+    Free(sketch->door);
+}
+
+/* checks the doorkeeper for a key, adding it if absent */
+static int door_test_and_set(Sketch_t *sketch, unsigned int hash) {
+    int i, present = 1;
+    for (i = 0; i < 2; i++) {
+        unsigned int bit = rehash(hash, SKETCH_DEPTH + i) & (sketch->door_bits - 1);
+        unsigned long mask = 1UL << (bit % LONG_BITS);
+        if (!(sketch->door[bit / LONG_BITS] & mask)) {
+            present = 0;
+            sketch->door[bit / LONG_BITS] |= mask;
+        }
+    }
+    return present;
+}
+
+/* checks the doorkeeper for a key */
+static int door_test(Sketch_t *sketch, unsigned int hash) {
+    int i;
+    for (i = 0; i < 2; i++) {
+        unsigned int bit = rehash(hash, SKETCH_DEPTH + i) & (sketch->door_bits - 1);
+        if (!(sketch->door[bit / LONG_BITS] & (1UL << (bit % LONG_BITS)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* halves every counter and clears the doorkeeper */
+static void sketch_age(Sketch_t *sketch) {
+    unsigned int i;
+    for (i = 0; i < SKETCH_DEPTH * sketch->width; i++) {
+        sketch->table[i] >>= 1;
+    }
+    memset(sketch->door, 0, sketch->door_bits / 8);
+    sketch->additions /= 2;
+}
+
+/* records one access of the key with the given hash */
+void sketch_increment(Sketch_t *sketch, unsigned int hash) {
+    int i;
+
+    if (door_test_and_set(sketch, hash)) {
+        for (i = 0; i < SKETCH_DEPTH; i++) {
+            unsigned char *counter = &sketch->table[i * sketch->width +
+                                     (rehash(hash, i) & (sketch->width - 1))];
+            if (*counter < SKETCH_MAX_COUNT) {
+                (*counter)++;
+            }
+        }
+    }
+    if (++sketch->additions >= sketch->sample_size) {
+        sketch_age(sketch);
+    }
+}
+
+/* returns the estimated access count of the key with the given hash */
+int sketch_estimate(Sketch_t *sketch, unsigned int hash) {
+    int i, min = SKETCH_MAX_COUNT;
+    for (i = 0; i < SKETCH_DEPTH; i++) {
+        int count = sketch->table[i * sketch->width + (rehash(hash, i) & (sketch->width - 1))];
+        if (count < min) {
+            min = count;
+        }
+    }
+    return min + door_test(sketch, hash);
+}
+
+/* $end sketch.c */
@@ -0,0 +1,45 @@
+/*
+ * sketch.h - count-min sketch with a doorkeeper for TinyLFU admission,
+ * definition and prototypes.
+ */
+/* $begin sketch.h */
+#ifndef __SKETCH_H__
+#define __SKETCH_H__
+
+#include "csapp.h"
+
+#define SKETCH_DEPTH 4       /* rows, one hash function each */
+#define SKETCH_MAX_COUNT 15  /* counters saturate here */
+
+/*
+ * approximate access frequencies. A key is first remembered by the
+ * doorkeeper Bloom filter and only counted in the sketch from its second
+ * access on, so one-hit wonders do not pollute the counters. After
+ * sample_size additions all counters are halved and the doorkeeper is
+ * cleared, so old popularity fades.
+ */
+typedef struct Sketch {
+    unsigned char *table;      /* SKETCH_DEPTH rows of width counters */
+    unsigned long *door;       /* doorkeeper bits */
+    unsigned int width;        /* counters per row, a power of 2 */
+    unsigned int door_bits;    /* bits in the doorkeeper, a power of 2 */
+    unsigned int additions;    /* additions since the last aging */
+    unsigned int sample_size;  /* additions between two agings */
+} Sketch_t;
+
+/* function prototypes */
+
+/* initializes a sketch with width counters per row */
+void sketch_init(Sketch_t *sketch, unsigned int width);
+
+/* frees the counters of a sketch */
+void sketch_free(Sketch_t *sketch);
+
+/* records one access of the key with the given hash */
+void sketch_increment(Sketch_t *sketch, unsigned int hash);
+
+/* returns the estimated access count of the key with the given hash */
+int sketch_estimate(Sketch_t *sketch, unsigned int hash);
+
+#endif /* __SKETCH_H__ */
+/* $end sketch.h */
@@ -0,0 +1,250 @@
+/*
+ * stats.c - request latency histograms and counters.
+ *
+ * Histograms are HDR style: a value of v microseconds goes to one of
+ * HIST_SUB linear buckets within its power of 2, so recording is a
+ * count-leading-zeros and three relaxed atomic adds, the relative error
+ * stays under 1/HIST_SUB from microseconds to hours, and no range has
+ * to be chosen up front. The fixed Prometheus "le" buckets are only
+ * summed out of them when the stats are read.
+ */
+/* $begin stats.c */
+#include "stats.h"
+#include "cache.h"
+#include "dns.h"
+
+Stats_t stats;
+
+/* upper bounds of the exported buckets, microseconds */
+static const long bounds[] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000, 60000000
+};
+
+const char *stats_sources[] = { "hit", "miss", "shared" };
+
+long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* returns the bucket of a value */
+static int hist_index(unsigned long v) {
+    int shift;
+
+    if (v < HIST_SUB) {
+        return v;
+    }
+    shift = 63 - __builtin_clzl(v) - HIST_SUB_BITS;
+    if (shift > HIST_MAX_SHIFT) {
+        return HIST_BUCKETS - 1;
+    }
+    return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+/* returns the largest value of a bucket */
+static unsigned long hist_max(int i) {
+    int shift;
+
+    if (i < HIST_SUB) {
+        return i;
+    }
+    shift = i / HIST_SUB - 1;
+    return ((unsigned long)(HIST_SUB + i % HIST_SUB + 1) << shift) - 1;
+}
+
+/*
+ * stats_observe - records a value of us microseconds in h, negative
+ * values as 0
+ */
+void stats_observe(Hist_t *h, long us) {
+    if (us < 0) {
+        us = 0;
+    }
+    __atomic_fetch_add(&h->counts[hist_index(us)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, us, __ATOMIC_RELAXED);
+}
+
+/*
+ * stats_add - adds n to a counter
+ */
+void stats_add(volatile unsigned long *counter, unsigned long n) {
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * stats_request - records a finished request from source, times in
+ * microseconds; first_byte is 0 if the client got nothing
+ */
+void stats_request(int source, long accepted, long start, long first_byte,
+        size_t sent) {
+    if (first_byte != 0) {
+        stats_observe(&stats.first_byte[source], first_byte - accepted);
+    }
+    stats_observe(&stats.request[source], now_us() - start);
+    stats_add(&stats.client_bytes_out, sent);
+}
+
+static unsigned long load(volatile unsigned long *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void format_family(Buf_t *out, const char *name, const char *type,
+        const char *help) {
+    buf_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/*
+ * appends the series of one histogram, labels being "" or a list to go
+ * before le. A bucket is counted under the first bound that all of its
+ * values are within, so a count may land one bound late by at most
+ * 1/HIST_SUB of the value
+ */
+static void format_hist(Buf_t *out, const char *name, const char *labels, Hist_t *h) {
+    const char *sep = (labels[0] != '\0') ? "," : "";
+    unsigned long total = 0;
+    size_t b = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        while (b < sizeof(bounds) / sizeof(bounds[0]) && hist_max(i) > bounds[b]) {
+            buf_printf(out, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels, sep,
+                       bounds[b] / 1e6, total);
+            b++;
+        }
+        total += load(&h->counts[i]);
+    }
+    for (; b < sizeof(bounds) / sizeof(bounds[0]); b++) {
+        buf_printf(out, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels, sep,
+                   bounds[b] / 1e6, total);
+    }
+    /* the total of the buckets, so +Inf and _count agree under updates */
+    buf_printf(out, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep, total);
+    if (labels[0] != '\0') {
+        buf_printf(out, "%s_sum{%s} %.6f\n", name, labels, load(&h->sum) / 1e6);
+        buf_printf(out, "%s_count{%s} %lu\n", name, labels, total);
+    } else {
+        buf_printf(out, "%s_sum %.6f\n", name, load(&h->sum) / 1e6);
+        buf_printf(out, "%s_count %lu\n", name, total);
+    }
+}
+
+/* appends a histogram family split by where the response came from */
+static void format_sources(Buf_t *out, const char *name, const char *help, Hist_t *h) {
+    char labels[32];
+    int i;
+
+    format_family(out, name, "histogram", help);
+    for (i = 0; i < STATS_SOURCES; i++) {
+        snprintf(labels, sizeof(labels), "cache=\"%s\"", stats_sources[i]);
+        format_hist(out, name, labels, &h[i]);
+    }
+}
+
+/* appends a family of one unlabelled series */
+static void format_value(Buf_t *out, const char *name, const char *type,
+        const char *help, unsigned long value) {
+    format_family(out, name, type, help);
+    buf_printf(out, "%s %lu\n", name, value);
+}
+
+/*
+ * stats_format - appends every statistic to out in the Prometheus text
+ * format, version 0.0.4
+ */
+void stats_format(Buf_t *out) {
+    Dns_stats_t dns;
+
+    format_sources(out, "proxy_first_byte_seconds",
+                   "Time from accept, or the request head on a reused connection, "
+                   "to the first response byte.", stats.first_byte);
+    format_sources(out, "proxy_request_duration_seconds",
+                   "Time from the request head to the last response byte.",
+                   stats.request);
+
+    format_family(out, "proxy_upstream_connect_seconds", "histogram",
+                  "Time to open a new origin connection.");
+    format_hist(out, "proxy_upstream_connect_seconds", "", &stats.upstream_connect);
+    format_family(out, "proxy_upstream_ttfb_seconds", "histogram",
+                  "Time from sending a request to the origin to its response head.");
+    format_hist(out, "proxy_upstream_ttfb_seconds", "", &stats.upstream_ttfb);
+
+    format_value(out, "proxy_cache_hits_total", "counter",
+                 "Requests answered from the cache.",
+                 load(&stats.request[STATS_HIT].count));
+    format_value(out, "proxy_cache_misses_total", "counter",
+                 "Requests fetched from the origin.",
+                 load(&stats.request[STATS_MISS].count));
+    format_value(out, "proxy_cache_shared_total", "counter",
+                 "Requests streamed from a fetch already under way.",
+                 load(&stats.request[STATS_SHARED].count));
+    format_value(out, "proxy_cache_evictions_total", "counter",
+                 "Responses dropped from the cache.", load(&cache_evictions));
+    format_value(out, "proxy_cache_bytes", "gauge",
+                 "Size of the cached responses.", cache_size);
+
+    format_value(out, "proxy_client_bytes_received_total", "counter",
+                 "Request head bytes read from clients.", load(&stats.client_bytes_in));
+    format_value(out, "proxy_client_bytes_sent_total", "counter",
+                 "Response bytes sent to clients.", load(&stats.client_bytes_out));
+    format_value(out, "proxy_origin_bytes_received_total", "counter",
+                 "Response bytes read from origins.", load(&stats.origin_bytes_in));
+    format_value(out, "proxy_origin_bytes_sent_total", "counter",
+                 "Request bytes sent to origins.", load(&stats.origin_bytes_out));
+
+    format_family(out, "proxy_active_connections", "gauge",
+                  "Client connections being served.");
+    buf_printf(out, "proxy_active_connections %ld\n",
+               __atomic_load_n(&stats.active_connections, __ATOMIC_RELAXED));
+
+    dns_stats(&dns);
+    format_family(out, "proxy_dns_lookups_total", "counter", "Origin name lookups.");
+    buf_printf(out, "proxy_dns_lookups_total{result=\"hit\"} %lu\n", dns.hits);
+    buf_printf(out, "proxy_dns_lookups_total{result=\"negative_hit\"} %lu\n",
+               dns.negative_hits);
+    buf_printf(out, "proxy_dns_lookups_total{result=\"miss\"} %lu\n", dns.misses);
+    buf_printf(out, "proxy_dns_lookups_total{result=\"stale\"} %lu\n", dns.stale);
+}
+
+/*
+ * stats_local - returns 1 if the peer of a connected socket is on the
+ * loopback network, IPv4 mapped addresses included
+ */
+int stats_local(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    struct in6_addr *in6 = &((struct sockaddr_in6 *)&addr)->sin6_addr;
+
+    if (getpeername(fd, (SA *)&addr, &len) < 0) {
+        return 0;
+    }
+    if (addr.ss_family == AF_INET) {
+        return (ntohl(((struct sockaddr_in *)&addr)->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (addr.ss_family == AF_INET6) {
+        return IN6_IS_ADDR_LOOPBACK(in6) ||
+               (IN6_IS_ADDR_V4MAPPED(in6) && in6->s6_addr[12] == 127);
+    }
+    return 0;
+}
+
+/*
+ * stats_response - appends the whole response to a request for
+ * STATS_PATH to out, keeping the connection open if keepalive is set
+ */
+void stats_response(Buf_t *out, int keepalive) {
+    Buf_t body;
+
+    buf_init(&body);
+    stats_format(&body);
+    buf_printf(out, "HTTP/1.1 200 OK\r\n"
+               "Content-Type: text/plain; version=0.0.4\r\n"
+               "Content-Length: %zu\r\n"
+               "Connection: %s\r\n\r\n",
+               body.len, keepalive ? "keep-alive" : "close");
+    buf_append(out, body.data, body.len);
+    buf_free(&body);
+}
+/* $end stats.c */
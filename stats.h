@@ -0,0 +1,84 @@
+/*
+ * stats.h - request latency histograms and counters, definitions and
+ * prototypes.
+ */
+/* $begin stats.h */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "csapp.h"
+#include "buf.h"
+
+#define STATS_PATH "/__proxy/stats"  /* admin URL, answered for loopback clients */
+
+/*
+ * a histogram has HIST_SUB buckets per power of 2 of microseconds, so a
+ * bucket is at most 1/HIST_SUB of its values wide; values from
+ * 2^HIST_MAX_SHIFT * HIST_SUB microseconds (about 19 hours) up share the
+ * last bucket
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_SHIFT 31
+#define HIST_BUCKETS ((HIST_MAX_SHIFT + 2) * HIST_SUB)
+
+/* where a response came from, the split of the request histograms */
+#define STATS_HIT 0
+#define STATS_MISS 1
+#define STATS_SHARED 2  /* streamed from a fetch of another request */
+#define STATS_SOURCES 3
+
+/* log-linear histogram of microseconds, updated without locks */
+typedef struct Hist {
+    volatile unsigned long counts[HIST_BUCKETS];
+    volatile unsigned long count;
+    volatile unsigned long sum;  /* microseconds */
+} Hist_t;
+
+typedef struct Stats {
+    Hist_t first_byte[STATS_SOURCES];  /* accept or request head to the first response byte */
+    Hist_t request[STATS_SOURCES];     /* request head to the last response byte */
+    Hist_t upstream_connect;           /* new origin connections only */
+    Hist_t upstream_ttfb;              /* request sent to the origin's response head */
+    volatile unsigned long client_bytes_in;   /* request heads */
+    volatile unsigned long client_bytes_out;  /* responses */
+    volatile unsigned long origin_bytes_in;   /* responses of origins */
+    volatile unsigned long origin_bytes_out;  /* requests to origins */
+    volatile long active_connections;
+} Stats_t;
+
+extern Stats_t stats;
+
+/* names of the STATS_ sources, for labels and the access log */
+extern const char *stats_sources[];
+
+/* function prototypes */
+
+/* returns the current time in microseconds */
+long now_us();
+
+/* records a value of us microseconds in h */
+void stats_observe(Hist_t *h, long us);
+
+/* adds n to a counter */
+void stats_add(volatile unsigned long *counter, unsigned long n);
+
+/*
+ * records a finished request from source: its time from start, its first
+ * byte from accepted if it got one (first_byte not 0), and the bytes
+ * sent; all times in microseconds
+ */
+void stats_request(int source, long accepted, long start, long first_byte,
+        size_t sent);
+
+/* appends every statistic to out in the Prometheus text format */
+void stats_format(Buf_t *out);
+
+/* returns 1 if the peer of a connected socket is local, and may read STATS_PATH */
+int stats_local(int fd);
+
+/* appends the whole response to a request for STATS_PATH to out */
+void stats_response(Buf_t *out, int keepalive);
+
+#endif /* __STATS_H__ */
+/* $end stats.h */
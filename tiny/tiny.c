@@ -98,13 +98,13 @@ void doit(int fd)
 /* $begin read_requesthdrs */
 void read_requesthdrs(rio_t *rp) 
 {
-    char buf[MAXLINE];
+    char *line;
+    ssize_t n;
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
-    while(strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
-	Rio_readlineb(rp, buf, MAXLINE);
-	printf("%s", buf);
+    while ((n = Rio_readlinep(rp, &line)) > 0) {
+	printf("%.*s", (int)n, line);
+	if (n == 2 && !memcmp(line, "\r\n", 2)) //line:netp:readhdrs:checkterm
+	    break;
     }
     return;
 }
@@ -0,0 +1,135 @@
+/*
+ * upstream.c - pool of persistent connections to origin servers.
+ *
+ * Idle connections are kept per (host, port) in a small hash table under
+ * one mutex, at most UPSTREAM_MAX_PER_HOST of them. Connections idle for
+ * longer than UPSTREAM_IDLE_TIMEOUT, or closed by the origin meanwhile,
+ * are dropped when they are next looked at.
+ */
+/* $begin upstream.c */
+#include "upstream.h"
+#include "cache.h"
+#include "connect.h"
+
+int upstream_keepalive = 0;
+
+static Origin_t *origin_table[UPSTREAM_BUCKETS];
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* initializes the pool */
+void init_upstream() {
+    memset(origin_table, 0, sizeof(origin_table));
+}
+
+/* finds the origin for host:port, creating it if asked, pool_mutex must be held */
+static Origin_t *find_origin(char *host, char *port, int create) {
+    unsigned int hash = hash_uri(host) ^ hash_uri(port);
+    Origin_t *origin;
+
+    for (origin = origin_table[hash & (UPSTREAM_BUCKETS - 1)]; origin != NULL;
+         origin = origin->hnext) {
+        if (origin->hash == hash && !strcasecmp(origin->host, host) &&
+            !strcmp(origin->port, port)) {
+            return origin;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    origin = (Origin_t *)Calloc(1, sizeof(Origin_t));
+    origin->host = strdup(host);
+    origin->port = strdup(port);
+    origin->hash = hash;
+    origin->hnext = origin_table[hash & (UPSTREAM_BUCKETS - 1)];
+    origin_table[hash & (UPSTREAM_BUCKETS - 1)] = origin;
+    return origin;
+}
+
+/* returns 1 if an idle connection is still open with nothing to read */
+static int upstream_alive(Upstream_t *up) {
+    char c;
+
+    if (time(NULL) - up->idle_since > UPSTREAM_IDLE_TIMEOUT) {
+        return 0;
+    }
+    return recv(up->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+           (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * returns a connection to host:port, an idle one if there is a live one
+ * (*reused is then set to 1), or -1 if it cannot connect before deadline
+ */
+int upstream_get(char *host, char *port, int *reused, long deadline) {
+    Origin_t *origin;
+    Upstream_t *up;
+    int fd;
+
+    while (1) {
+        pthread_mutex_lock(&pool_mutex);
+        up = NULL;
+        if ((origin = find_origin(host, port, 0)) != NULL && origin->idle != NULL) {
+            up = origin->idle;
+            origin->idle = up->next;
+            origin->nidle--;
+        }
+        pthread_mutex_unlock(&pool_mutex);
+
+        if (up == NULL) {
+            break;
+        }
+        fd = up->fd;
+        if (upstream_alive(up)) {
+            Free(up);
+            *reused = 1;
+            return fd;
+        }
+        close(fd);
+        Free(up);
+    }
+
+    *reused = 0;
+    return connect_host(host, port, deadline);
+}
+
+/*
+ * returns a connection that finished a response to the pool, dropping the
+ * expired ones and the least recently used one over the limit
+ */
+void upstream_put(char *host, char *port, int fd) {
+    Origin_t *origin;
+    Upstream_t *up = (Upstream_t *)Malloc(sizeof(Upstream_t)), **pos, *dead = NULL;
+    time_t now = time(NULL);
+
+    up->fd = fd;
+    up->idle_since = now;
+
+    pthread_mutex_lock(&pool_mutex);
+    origin = find_origin(host, port, 1);
+    up->next = origin->idle;
+    origin->idle = up;
+    origin->nidle++;
+    for (pos = &origin->idle; *pos != NULL; ) {
+        if (now - (*pos)->idle_since > UPSTREAM_IDLE_TIMEOUT ||
+            ((*pos)->next == NULL && origin->nidle > UPSTREAM_MAX_PER_HOST)) {
+            up = *pos;
+            *pos = up->next;
+            up->next = dead;
+            dead = up;
+            origin->nidle--;
+        } else {
+            pos = &(*pos)->next;
+        }
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    while (dead != NULL) {
+        up = dead;
+        dead = up->next;
+        close(up->fd);
+        Free(up);
+    }
+}
+
+/* $end upstream.c */
@@ -0,0 +1,49 @@
+/*
+ * upstream.h - pool of persistent connections to origin servers,
+ * definition and prototypes.
+ */
+/* $begin upstream.h */
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include "csapp.h"
+
+#define UPSTREAM_BUCKETS 64
+#define UPSTREAM_MAX_PER_HOST 8   /* idle connections kept per origin */
+#define UPSTREAM_IDLE_TIMEOUT 30  /* seconds an idle connection is kept */
+
+/* an idle connection to an origin */
+typedef struct Upstream {
+    struct Upstream *next;
+    int fd;
+    time_t idle_since;
+} Upstream_t;
+
+/* the idle connections to one host and port, most recently used first */
+typedef struct Origin {
+    struct Origin *hnext;  /* next origin in the same bucket */
+    char *host;
+    char *port;
+    unsigned int hash;
+    Upstream_t *idle;
+    int nidle;
+} Origin_t;
+
+extern int upstream_keepalive;
+
+/* function prototypes */
+
+/* initializes the pool */
+void init_upstream();
+
+/*
+ * returns a connection to host:port, an idle one if there is a live one
+ * (*reused is then set to 1), or -1 if it cannot connect before deadline
+ */
+int upstream_get(char *host, char *port, int *reused, long deadline);
+
+/* returns a connection that finished a response to the pool */
+void upstream_put(char *host, char *port, int fd);
+
+#endif /* __UPSTREAM_H__ */
+/* $end upstream.h */
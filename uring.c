@@ -0,0 +1,899 @@
+/*
+ * uring.c - io_uring based connection engine for the web proxy.
+ *
+ * The ring is driven by raw system calls. Every connection is a chain of
+ * completions instead of readiness events:
+ *
+ *   - one multishot accept keeps producing client descriptors
+ *   - the request head is received into the connection
+ *   - a cache hit is sent straight from the pinned node
+ *   - a miss has the origin looked up by a resolver thread, which wakes
+ *     the ring through an eventfd read, connects to it, then submits the
+ *     request send linked to the first response read, and relays each
+ *     chunk with a client write linked to the next origin read, both on
+ *     a registered buffer
+ *
+ * A short write breaks a link: the kernel cancels the read and the
+ * remainder is resubmitted with a fresh pair. The head receive, each
+ * connect and each origin read carry a linked timeout for the idle
+ * timeout, the address's share of the connect time, and the deadline of
+ * the first response byte or, once the relay is under way, read_timeout
+ * for each read; every send and write carries one of request_timeout,
+ * so a client that stops reading cannot pin its connection. A timer
+ * ticks while lookups are outstanding or accepting is paused: lookups
+ * past the connect time get a 504, and an accept that failed for want
+ * of descriptors or memory is only retried on a tick or once a
+ * connection closes, rather than spinning the ring. run_uring probes for every operation used before choosing
+ * the engine. Requests are timed into the same histograms as the worker
+ * engine's, and the statistics are served at STATS_PATH.
+ */
+/* $begin uring.c */
+#include "uring.h"
+#include "cache.h"
+#include "proxy.h"
+#include "dns.h"
+#include "connect.h"
+#include "stats.h"
+#include "log.h"
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+/* completion kinds, kept in the low bits of user_data */
+#define OP_ACCEPT 0
+#define OP_HEAD 1
+#define OP_SEND 2
+#define OP_CONNECT 3
+#define OP_LINK 4
+#define OP_READ 5
+#define OP_TIMEOUT 6  /* a linked timeout, no connection, or the tick */
+#define OP_WAKE 7     /* the eventfd read, no connection */
+#define OP_MASK 7
+
+typedef struct Uconn {
+    int client;
+    int server;
+    char head[MAXBUF];   /* request head from the client */
+    size_t head_len;
+    char uri[MAXLINE];
+    Buf_t out;           /* request for the origin, or an error response */
+    size_t out_off;
+    Node_t *node;        /* pinned cache hit being sent */
+    size_t node_off;
+    char *buf;           /* relay buffer */
+    int buf_index;       /* registered buffer index, -1 if not registered */
+    size_t buf_len;
+    size_t buf_off;
+    int relaying;        /* the origin has started answering */
+    int link_res;        /* result of the first half of a linked pair */
+    char *fill;          /* copy of the response for the cache, NULL once too large */
+    size_t fill_len;
+    Dns_addr_t addrs[DNS_MAX_ADDRS];  /* origin addresses, addr is being tried */
+    int naddrs;
+    int addr;
+    long head_end;       /* milliseconds, from now_ms, the request head is due */
+    long connect_end;    /* connecting gives up */
+    long fetch_end;      /* the origin has not started answering, gives up */
+    int source;          /* STATS_HIT or STATS_MISS */
+    long accepted;       /* microseconds, as the stats time them */
+    long start;          /* the request head was in, 0 for no request to time */
+    long first_byte;     /* the client got the first response byte, 0 before */
+    long connecting;     /* the connect to the current address started */
+    long forwarded;      /* the request was sent to the origin */
+    size_t sent;         /* response bytes written to the client */
+    struct __kernel_timespec timeout;       /* of the read's linked timeout being queued */
+    struct __kernel_timespec send_timeout;  /* of the send's */
+    Dns_job_t *job;                         /* lookup being waited for, NULL if none */
+    struct Uconn *wait_prev;                /* links of the connections waiting for one */
+    struct Uconn *wait_next;
+} Uconn_t;
+
+static Ring_t ring;
+static int listen_fd;
+static int accept_multishot = 1;
+static char *buffers;                    /* URING_BUFFERS registered buffers */
+static int free_buffers[URING_BUFFERS];  /* stack of unused buffer indexes */
+static int nfree_buffers;
+
+/* lookups the resolver threads finished, and the eventfd they wake the ring with */
+static Dns_job_t *resolved;
+static pthread_mutex_t resolved_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int wake_fd;
+static uint64_t wake_count;
+
+/* connections waiting for a lookup, swept on each tick */
+static Uconn_t *waiting;
+
+/* the tick, its user_data is its own address */
+#define TICK_MS 250
+static struct __kernel_timespec tick_time = { 0, TICK_MS * 1000000L };
+static int tick_queued;
+static int accept_paused;  /* accept failed for want of resources */
+
+/* operations the engine submits, see ring_probe */
+static const int ring_ops[] = {
+    IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_CONNECT,
+    IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+    IORING_OP_LINK_TIMEOUT, IORING_OP_TIMEOUT
+};
+
+/* maps a part of the ring, returns NULL if it cannot */
+static void *ring_map(Ring_t *r, size_t size, off_t offset) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, offset);
+
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/* unmaps whatever of the ring is mapped and closes it */
+static void ring_free(Ring_t *r) {
+    if (r->sqes != NULL) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ring != NULL && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    if (r->sq_ring != NULL) {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+    close(r->fd);
+}
+
+/* returns 1 if the kernel supports every operation in ring_ops */
+static int ring_probe(Ring_t *r) {
+    struct io_uring_probe *probe;
+    size_t i;
+    int ok = 1, op;
+
+    probe = (struct io_uring_probe *)Calloc(1, sizeof(struct io_uring_probe) +
+                                            IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PROBE, probe,
+                IORING_OP_LAST) < 0) {
+        ok = 0;
+    }
+    for (i = 0; ok && i < sizeof(ring_ops) / sizeof(ring_ops[0]); i++) {
+        op = ring_ops[i];
+        ok = op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+    Free(probe);
+    return ok;
+}
+
+/*
+ * sets up the ring, returns -1 if io_uring is unavailable or lacks an
+ * operation the engine needs
+ */
+static int ring_init(Ring_t *r, unsigned entries) {
+    struct io_uring_params p;
+    char *sq, *cq;
+
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+        return -1;
+    }
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    if ((r->sq_ring = ring_map(r, r->sq_ring_size, IORING_OFF_SQ_RING)) == NULL) {
+        ring_free(r);
+        return -1;
+    }
+    r->cq_ring = r->sq_ring;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) &&
+        (r->cq_ring = ring_map(r, r->cq_ring_size, IORING_OFF_CQ_RING)) == NULL) {
+        ring_free(r);
+        return -1;
+    }
+    if ((r->sqes = ring_map(r, r->sqes_size, IORING_OFF_SQES)) == NULL ||
+        !ring_probe(r)) {
+        ring_free(r);
+        return -1;
+    }
+    sq = r->sq_ring;
+    cq = r->cq_ring;
+
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->sq_local = r->sq_flushed = *r->sq_tail;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+/* hands the queued entries to the kernel, waiting for wait completions */
+static void ring_enter(Ring_t *r, unsigned wait) {
+    int n;
+
+    __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+    do {
+        n = syscall(__NR_io_uring_enter, r->fd, r->sq_local - r->sq_flushed,
+                    wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        unix_error("io_uring_enter error");
+    }
+    r->sq_flushed += n;
+}
+
+/* returns a zeroed submission entry, submitting first if the queue is full */
+static struct io_uring_sqe *ring_sqe(Ring_t *r) {
+    struct io_uring_sqe *sqe;
+    unsigned index;
+
+    while (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        ring_enter(r, 0);
+    }
+    index = r->sq_local & *r->sq_mask;
+    sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[index] = index;
+    r->sq_local++;
+    return sqe;
+}
+
+/* queues an operation on fd for a connection */
+static struct io_uring_sqe *queue_op(int opcode, int fd, void *addr,
+        unsigned len, Uconn_t *conn, int op) {
+    struct io_uring_sqe *sqe = ring_sqe(&ring);
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)addr;
+    sqe->len = len;
+    sqe->user_data = (unsigned long)conn | op;
+    return sqe;
+}
+
+/* registers the relay buffers, running without them if that fails */
+static void init_buffers(void) {
+    struct iovec iov[URING_BUFFERS];
+    int i;
+
+    buffers = (char *)Malloc(URING_BUFFERS * MAXBUF);
+    for (i = 0; i < URING_BUFFERS; i++) {
+        iov[i].iov_base = buffers + i * MAXBUF;
+        iov[i].iov_len = MAXBUF;
+    }
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS,
+                iov, URING_BUFFERS) < 0) {
+        return;
+    }
+    for (i = 0; i < URING_BUFFERS; i++) {
+        free_buffers[i] = URING_BUFFERS - 1 - i;
+    }
+    nfree_buffers = URING_BUFFERS;
+}
+
+/*
+ * queues a timeout of the operation just queued with IOSQE_IO_LINK, at
+ * end (milliseconds, from now_ms), kept in ts; the operation then fails
+ * with -ECANCELED if it has not completed. Returns the timeout's entry,
+ * which may link on to the next operation
+ */
+static struct io_uring_sqe *queue_timeout(struct __kernel_timespec *ts, long end) {
+    long left = end - now_ms();
+
+    if (left < 1) {
+        left = 1;
+    }
+    ts->tv_sec = left / 1000;
+    ts->tv_nsec = (left % 1000) * 1000000;
+    /* the kernel copies the time on submission, before the connection may go */
+    return queue_op(IORING_OP_LINK_TIMEOUT, -1, ts, 1, NULL, OP_TIMEOUT);
+}
+
+/*
+ * bounds the send or write just queued with IOSQE_IO_LINK by
+ * request_timeout; link is set if an operation linked to the send follows
+ */
+static void queue_send_timeout(Uconn_t *conn, int link) {
+    struct io_uring_sqe *sqe = queue_timeout(&conn->send_timeout, now_ms() + request_timeout);
+
+    if (link) {
+        sqe->flags = IOSQE_IO_LINK;
+    }
+}
+
+/* queues the tick unless it is queued already */
+static void queue_tick(void) {
+    struct io_uring_sqe *sqe;
+
+    if (!tick_queued) {
+        sqe = queue_op(IORING_OP_TIMEOUT, -1, &tick_time, 1, NULL, OP_TIMEOUT);
+        sqe->user_data = (unsigned long)&tick_time | OP_TIMEOUT;
+        tick_queued = 1;
+    }
+}
+
+/*
+ * queues a relay buffer read from the origin, bounded by the fetch
+ * deadline until the origin answers and by read_timeout after
+ */
+static void queue_read(Uconn_t *conn) {
+    struct io_uring_sqe *sqe;
+
+    if (conn->buf_index >= 0) {
+        sqe = queue_op(IORING_OP_READ_FIXED, conn->server, conn->buf, MAXBUF, conn, OP_READ);
+        sqe->buf_index = conn->buf_index;
+    } else {
+        sqe = queue_op(IORING_OP_READ, conn->server, conn->buf, MAXBUF, conn, OP_READ);
+    }
+    sqe->flags = IOSQE_IO_LINK;
+    queue_timeout(&conn->timeout, conn->relaying ? now_ms() + read_timeout : conn->fetch_end);
+}
+
+/* queues the unsent request linked to the next origin read */
+static void queue_forward(Uconn_t *conn) {
+    struct io_uring_sqe *sqe;
+
+    sqe = queue_op(IORING_OP_SEND, conn->server, conn->out.data + conn->out_off,
+                   conn->out.len - conn->out_off, conn, OP_LINK);
+    sqe->flags = IOSQE_IO_LINK;
+    queue_send_timeout(conn, 1);
+    queue_read(conn);
+}
+
+/* queues the unwritten relay bytes linked to the next origin read */
+static void queue_relay(Uconn_t *conn) {
+    struct io_uring_sqe *sqe;
+    char *start = conn->buf + conn->buf_off;
+    unsigned len = conn->buf_len - conn->buf_off;
+
+    if (conn->buf_index >= 0) {
+        sqe = queue_op(IORING_OP_WRITE_FIXED, conn->client, start, len, conn, OP_LINK);
+        sqe->buf_index = conn->buf_index;
+    } else {
+        sqe = queue_op(IORING_OP_WRITE, conn->client, start, len, conn, OP_LINK);
+    }
+    sqe->flags = IOSQE_IO_LINK;
+    queue_send_timeout(conn, 1);
+    queue_read(conn);
+}
+
+/* queues the rest of a cache hit or error response */
+static void queue_send(Uconn_t *conn) {
+    struct io_uring_sqe *sqe;
+
+    if (conn->node) {
+        sqe = queue_op(IORING_OP_SEND, conn->client, conn->node->response + conn->node_off,
+                       conn->node->size - conn->node_off, conn, OP_SEND);
+    } else {
+        sqe = queue_op(IORING_OP_SEND, conn->client, conn->out.data + conn->out_off,
+                       conn->out.len - conn->out_off, conn, OP_SEND);
+    }
+    sqe->flags = IOSQE_IO_LINK;
+    queue_send_timeout(conn, 0);
+}
+
+/* queues the next request head read, bounded by the idle timeout */
+static void queue_head(Uconn_t *conn) {
+    struct io_uring_sqe *sqe;
+
+    sqe = queue_op(IORING_OP_RECV, conn->client, conn->head + conn->head_len,
+                   sizeof(conn->head) - 1 - conn->head_len, conn, OP_HEAD);
+    sqe->flags = IOSQE_IO_LINK;
+    queue_timeout(&conn->timeout, conn->head_end);
+}
+
+/* queues the read of the eventfd the resolver threads write */
+static void queue_wake(void) {
+    queue_op(IORING_OP_READ, wake_fd, &wake_count, sizeof(wake_count), NULL, OP_WAKE);
+}
+
+/* queues the accept, multishot unless the kernel refused it */
+static void queue_accept(void) {
+    struct io_uring_sqe *sqe = queue_op(IORING_OP_ACCEPT, listen_fd, NULL, 0, NULL, OP_ACCEPT);
+
+    if (accept_multishot) {
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+}
+
+/* closes both ends of a connection and frees it, nothing may be in flight */
+static void close_uconn(Uconn_t *conn) {
+    __atomic_fetch_sub(&stats.active_connections, 1, __ATOMIC_RELAXED);
+    if (conn->start != 0) {
+        stats_request(conn->source, conn->accepted, conn->start, conn->first_byte,
+                      conn->sent);
+    }
+    close(conn->client);
+    if (conn->server >= 0) {
+        close(conn->server);
+    }
+    if (conn->node) {
+        release_node(conn->node);
+    }
+    if (conn->buf_index >= 0) {
+        free_buffers[nfree_buffers++] = conn->buf_index;
+    } else {
+        Free(conn->buf);
+    }
+    buf_free(&conn->out);
+    Free(conn->fill);
+    Free(conn);
+    if (accept_paused) {
+        /* a descriptor is free again */
+        accept_paused = 0;
+        queue_accept();
+    }
+}
+
+/* counts n response bytes written to the client for the stats */
+static void count_sent(Uconn_t *conn, int n) {
+    if (conn->sent == 0) {
+        conn->first_byte = now_us();
+    }
+    conn->sent += n;
+}
+
+/* queues an error response, the connection closes once it is sent */
+static void send_error(Uconn_t *conn, char *cause, char *errnum,
+        char *shortmsg, char *longmsg) {
+    if (conn->server >= 0) {
+        close(conn->server);
+        conn->server = -1;
+    }
+    buf_free(&conn->out);
+    buf_init(&conn->out);
+    format_error(&conn->out, cause, errnum, shortmsg, longmsg);
+    conn->out_off = 0;
+    queue_send(conn);
+}
+
+/*
+ * queues a connect to the next origin address, giving it an equal share
+ * of the connect time left; answers 502, or 504 once the time is up,
+ * when no address is left
+ */
+static void try_connect(Uconn_t *conn) {
+    struct io_uring_sqe *sqe;
+    Dns_addr_t *addr;
+    long now = now_ms();
+
+    for (; conn->addr < conn->naddrs && now < conn->connect_end; conn->addr++) {
+        addr = &conn->addrs[conn->addr];
+        conn->server = socket(addr->family, addr->socktype, addr->protocol);
+        if (conn->server >= 0) {
+            conn->connecting = now_us();
+            sqe = queue_op(IORING_OP_CONNECT, conn->server, &addr->addr, 0,
+                           conn, OP_CONNECT);
+            sqe->off = addr->addrlen;
+            sqe->flags = IOSQE_IO_LINK;
+            queue_timeout(&conn->timeout, now + (conn->connect_end - now) /
+                          (conn->naddrs - conn->addr));
+            return;
+        }
+    }
+    if (now >= conn->connect_end) {
+        send_error(conn, "", "504", "Gateway Timeout",
+                   "Web Proxy timed out connecting to the server");
+    } else {
+        send_error(conn, "", "502", "Bad Gateway",
+                   "Web Proxy could not connect to the server");
+    }
+}
+
+/* starts connecting once the lookup of the origin is answered */
+static void on_lookup(Uconn_t *conn, Dns_job_t *job) {
+    if (job->naddrs < 0) {
+        send_error(conn, job->host, "502", "Bad Gateway",
+                   "Web Proxy could not resolve the server");
+        return;
+    }
+    memcpy(conn->addrs, job->addrs, job->naddrs * sizeof(Dns_addr_t));
+    conn->naddrs = job->naddrs;
+    conn->addr = 0;
+    interleave_addrs(conn->addrs, conn->naddrs);
+    try_connect(conn);
+}
+
+/* hands a finished lookup back to the ring, called on a resolver thread */
+static void lookup_done(Dns_job_t *job) {
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&resolved_mutex);
+    job->next = resolved;
+    resolved = job;
+    pthread_mutex_unlock(&resolved_mutex);
+    write(wake_fd, &one, sizeof(one));
+}
+
+/* unlinks a connection whose lookup is over from the waiting list */
+static void stop_waiting(Uconn_t *conn) {
+    if (conn->wait_prev != NULL) {
+        conn->wait_prev->wait_next = conn->wait_next;
+    } else {
+        waiting = conn->wait_next;
+    }
+    if (conn->wait_next != NULL) {
+        conn->wait_next->wait_prev = conn->wait_prev;
+    }
+    conn->job = NULL;
+}
+
+/* takes the lookups the resolver threads finished */
+static void on_wake(void) {
+    Dns_job_t *job, *next;
+
+    queue_wake();
+    pthread_mutex_lock(&resolved_mutex);
+    job = resolved;
+    resolved = NULL;
+    pthread_mutex_unlock(&resolved_mutex);
+
+    for (; job != NULL; job = next) {
+        next = job->next;
+        if (job->arg != NULL) {
+            stop_waiting((Uconn_t *)job->arg);
+            on_lookup((Uconn_t *)job->arg, job);
+        }
+        /* else the connection gave up on it */
+        Free(job);
+    }
+}
+
+/*
+ * handles the tick: answers 504 to the connections whose lookup outlived
+ * the connect time and retries a paused accept
+ */
+static void on_tick(void) {
+    Uconn_t *conn, *next;
+    long now = now_ms();
+
+    tick_queued = 0;
+    for (conn = waiting; conn != NULL; conn = next) {
+        next = conn->wait_next;
+        if (now >= conn->connect_end) {
+            /* the resolver thread still has the job, on_wake frees it */
+            conn->job->arg = NULL;
+            stop_waiting(conn);
+            send_error(conn, "", "504", "Gateway Timeout",
+                       "Web Proxy timed out resolving the server");
+        }
+    }
+    if (accept_paused) {
+        accept_paused = 0;
+        queue_accept();
+    }
+    if (waiting != NULL) {
+        queue_tick();
+    }
+}
+
+/* acts on a complete request head: cache hit, error or origin connect */
+static void start_request(Uconn_t *conn, Http_request_t *req, int rc) {
+    char method[MAXLINE], host[MAXLINE], port[MAXLINE], query[MAXLINE];
+    Dns_job_t *job;
+    long now;
+
+    if (rc < 0 || http_copy(method, MAXLINE, &req->method) < 0 ||
+        http_copy(conn->uri, MAXLINE, &req->target) < 0) {
+        send_error(conn, "", "400", "Bad Request",
+                   "Web Proxy could not parse the request");
+        return;
+    }
+    if (strcasecmp(method, "GET")) {
+        /* Not a GET request */
+        send_error(conn, method, "501", "Not Implemented",
+                   "Web Proxy does not implement this method");
+        return;
+    }
+    if (!strcmp(conn->uri, STATS_PATH)) {
+        if (!stats_local(conn->client)) {
+            send_error(conn, STATS_PATH, "403", "Forbidden",
+                       "Web Proxy serves its statistics to local clients only");
+            return;
+        }
+        buf_init(&conn->out);
+        stats_response(&conn->out, 0);
+        conn->out_off = 0;
+        queue_send(conn);
+        return;
+    }
+    conn->start = now_us();
+    stats_add(&stats.client_bytes_in, conn->head_len);
+
+    if ((conn->node = get_cache(conn->uri)) != NULL) {
+        /* uri in cache, send it straight from the pinned node */
+        conn->source = STATS_HIT;
+        queue_send(conn);
+        return;
+    }
+
+    /* uri not in cache */
+    conn->source = STATS_MISS;
+    parse_uri(conn->uri, host, port, query);
+    buf_init(&conn->out);
+    build_request(&conn->out, req, query, host, 0);
+    conn->out_off = 0;
+
+    now = now_ms();
+    conn->fetch_end = now + request_timeout;
+    conn->connect_end = (now + connect_timeout < conn->fetch_end) ?
+                        now + connect_timeout : conn->fetch_end;
+
+    /* the lookup may block, so unless the cache has it a resolver thread does it */
+    job = (Dns_job_t *)Malloc(sizeof(Dns_job_t));
+    strcpy(job->host, host);
+    strcpy(job->port, port);
+    job->done = lookup_done;
+    job->arg = conn;
+    if (dns_resolve_async(job)) {
+        on_lookup(conn, job);
+        Free(job);
+        return;
+    }
+    conn->job = job;
+    conn->wait_prev = NULL;
+    if ((conn->wait_next = waiting) != NULL) {
+        waiting->wait_prev = conn;
+    }
+    waiting = conn;
+    queue_tick();
+}
+
+/* the origin closed: cache the response if it fits and close up */
+static void finish_relay(Uconn_t *conn) {
+    Node_t *node;
+
+    if (conn->fill != NULL && conn->fill_len < MAX_OBJECT_SIZE) {
+        node = put_cache(conn->uri, conn->fill, conn->fill_len);
+        if (node) {
+            access_node(node);
+            release_node(node);
+        }
+    }
+    close_uconn(conn);
+}
+
+/* handles a completed origin read, the last operation of a linked pair */
+static void on_read(Uconn_t *conn, int res) {
+    size_t unsent;
+
+    if (res == -ECANCELED) {
+        /* the first half failed or came up short, which broke the link, or the read timed out */
+        unsent = conn->relaying ? conn->buf_len - conn->buf_off : conn->out.len - conn->out_off;
+        if (conn->link_res <= 0) {
+            if (conn->relaying) {
+                close_uconn(conn);
+            } else {
+                send_error(conn, "", "502", "Bad Gateway",
+                           "Web Proxy could not send the request");
+            }
+        } else if ((size_t)conn->link_res == unsent) {
+            /* all of it went, so the read timed out */
+            if (conn->relaying) {
+                close_uconn(conn);
+            } else {
+                send_error(conn, "", "504", "Gateway Timeout",
+                           "Web Proxy timed out waiting for the server");
+            }
+        } else if (conn->relaying) {
+            conn->buf_off += conn->link_res;
+            queue_relay(conn);
+        } else {
+            conn->out_off += conn->link_res;
+            queue_forward(conn);
+        }
+        return;
+    }
+    if (res < 0) {
+        if (conn->relaying) {
+            close_uconn(conn);
+        } else {
+            send_error(conn, "", "502", "Bad Gateway",
+                       "Web Proxy could not read the response");
+        }
+        return;
+    }
+    if (res == 0) {
+        finish_relay(conn);
+        return;
+    }
+
+    if (!conn->relaying) {
+        stats_observe(&stats.upstream_ttfb, now_us() - conn->forwarded);
+        conn->relaying = 1;
+        conn->fill = (char *)Malloc(MAX_OBJECT_SIZE);
+        conn->fill_len = 0;
+    }
+    if (conn->fill != NULL) {
+        if (conn->fill_len + res < MAX_OBJECT_SIZE) {
+            memcpy(conn->fill + conn->fill_len, conn->buf, res);
+            conn->fill_len += res;
+        } else {
+            /* too large for the cache */
+            Free(conn->fill);
+            conn->fill = NULL;
+        }
+    }
+    stats_add(&stats.origin_bytes_in, res);
+    conn->buf_len = res;
+    conn->buf_off = 0;
+    queue_relay(conn);
+}
+
+/* handles the completion of a connection's operation */
+static void on_complete(Uconn_t *conn, int op, int res) {
+    Http_request_t req;
+    int rc;
+
+    switch (op) {
+    case OP_HEAD:
+        if (res <= 0) {
+            close_uconn(conn);
+            return;
+        }
+        conn->head_len += res;
+        conn->head[conn->head_len] = '\0';
+        if ((rc = http_parse_request(conn->head, conn->head_len, &req)) !=
+            HTTP_INCOMPLETE) {
+            start_request(conn, &req, rc);
+        } else if (conn->head_len == sizeof(conn->head) - 1) {
+            send_error(conn, "", "431", "Request Header Fields Too Large",
+                       "Web Proxy could not read the request");
+        } else {
+            queue_head(conn);
+        }
+        return;
+    case OP_SEND:
+        if (res <= 0) {
+            close_uconn(conn);
+            return;
+        }
+        count_sent(conn, res);
+        if (conn->node) {
+            conn->node_off += res;
+            if (conn->node_off < conn->node->size) {
+                queue_send(conn);
+                return;
+            }
+            access_node(conn->node);
+        } else {
+            conn->out_off += res;
+            if (conn->out_off < conn->out.len) {
+                queue_send(conn);
+                return;
+            }
+        }
+        close_uconn(conn);
+        return;
+    case OP_CONNECT:
+        if (res < 0) {
+            close(conn->server);
+            conn->server = -1;
+            conn->addr++;
+            try_connect(conn);
+            return;
+        }
+        stats_observe(&stats.upstream_connect, now_us() - conn->connecting);
+        conn->forwarded = now_us();
+        stats_add(&stats.origin_bytes_out, conn->out.len);
+        queue_forward(conn);
+        return;
+    case OP_LINK:
+        conn->link_res = res;
+        if (conn->relaying && res > 0) {
+            count_sent(conn, res);
+        }
+        return;
+    case OP_READ:
+        on_read(conn, res);
+        return;
+    }
+}
+
+/* handles an accept completion */
+static void on_accept(struct io_uring_cqe *cqe) {
+    Uconn_t *conn;
+
+    if (cqe->res == -EINVAL && accept_multishot) {
+        /* kernel without multishot accept */
+        accept_multishot = 0;
+        queue_accept();
+        return;
+    }
+    if (cqe->res == -EMFILE || cqe->res == -ENFILE || cqe->res == -ENOBUFS ||
+        cqe->res == -ENOMEM) {
+        /* accepting again at once would fail again, wait for a tick or a close */
+        log_msg(LOG_WARN, "accept error: %s, pausing", strerror(-cqe->res));
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            accept_paused = 1;
+            queue_tick();
+        }
+        return;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        queue_accept();
+    }
+    if (cqe->res < 0) {
+        return;
+    }
+
+    conn = (Uconn_t *)Malloc(sizeof(Uconn_t));
+    conn->client = cqe->res;
+    conn->server = -1;
+    conn->head_len = 0;
+    conn->out.data = NULL;
+    conn->out.len = conn->out.size = 0;
+    conn->node = NULL;
+    conn->node_off = 0;
+    conn->relaying = 0;
+    conn->fill = NULL;
+    conn->job = NULL;
+    conn->accepted = now_us();
+    conn->start = 0;
+    conn->first_byte = 0;
+    conn->sent = 0;
+    __atomic_fetch_add(&stats.active_connections, 1, __ATOMIC_RELAXED);
+    conn->head_end = now_ms() + 1000L * (client_idle_timeout > 0 ?
+                                         client_idle_timeout : CLIENT_IDLE_TIMEOUT);
+    if (nfree_buffers > 0) {
+        conn->buf_index = free_buffers[--nfree_buffers];
+        conn->buf = buffers + conn->buf_index * MAXBUF;
+    } else {
+        conn->buf_index = -1;
+        conn->buf = (char *)Malloc(MAXBUF);
+    }
+    queue_head(conn);
+}
+
+/*
+ * serves the connections accepted on listenfd with io_uring forever,
+ * returns -1 if the kernel does not support it
+ */
+int run_uring(int listenfd) {
+    struct io_uring_cqe cqe;
+    unsigned head;
+
+    if (ring_init(&ring, URING_ENTRIES) < 0) {
+        return -1;
+    }
+    if ((wake_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+        unix_error("eventfd error");
+    }
+    listen_fd = listenfd;
+    init_buffers();
+    queue_accept();
+    queue_wake();
+
+    while (1) {
+        if (cache_lockfree) {
+            /* buffered hits must not keep their nodes pinned while the ring waits */
+            drain_access();
+        }
+        ring_enter(&ring, 1);
+        head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = ring.cqes[head & *ring.cq_mask];
+            __atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+            if ((cqe.user_data & OP_MASK) == OP_ACCEPT) {
+                on_accept(&cqe);
+            } else if ((cqe.user_data & OP_MASK) == OP_WAKE) {
+                on_wake();
+            } else if (cqe.user_data == ((unsigned long)&tick_time | OP_TIMEOUT)) {
+                on_tick();
+            } else if ((cqe.user_data & OP_MASK) == OP_TIMEOUT) {
+                /* the linked operation reports for it */
+            } else {
+                on_complete((Uconn_t *)(unsigned long)(cqe.user_data & ~(unsigned long)OP_MASK),
+                            cqe.user_data & OP_MASK, cqe.res);
+            }
+        }
+    }
+    return 0;
+}
+
+/* $end uring.c */
@@ -0,0 +1,46 @@
+/*
+ * uring.h - io_uring based connection engine for the web proxy,
+ * definition and prototypes.
+ */
+/* $begin uring.h */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include "csapp.h"
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 1024  /* submission queue entries */
+#define URING_BUFFERS 256   /* registered relay buffers of MAXBUF bytes */
+
+/* an io_uring instance mapped without liburing */
+typedef struct Ring {
+    int fd;
+    void *sq_ring;        /* mappings, NULL until made */
+    size_t sq_ring_size;
+    void *cq_ring;        /* sq_ring if the kernel maps both at once */
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local;    /* tail including entries not yet published */
+    unsigned sq_flushed;  /* tail the kernel has been told about */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} Ring_t;
+
+/* function prototypes */
+
+/*
+ * serves the connections accepted on listenfd with io_uring forever,
+ * returns -1 if the kernel does not support it
+ */
+int run_uring(int listenfd);
+
+#endif /* __URING_H__ */
+/* $end uring.h */